@@ -0,0 +1,320 @@
+#include "bseries.h"
+#include "debug.h"
+
+#include <math.h>
+#include <float.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+
+
+/// Cross series aggregation
+///
+/// Every series is streamed block by block (write_ahead_size points at a time) into a buffer owned by the worker,
+/// each block is cut into runs of points that fall into the same bucket and every run is reduced with a kernel
+/// that skips null points (NaN for float series, the null fill byte for unsigned char series).
+/// Workers keep their own bucket accumulators, so peak memory is one block plus one set of buckets per worker.
+/// Series are aligned by their own header timestamp and interval, so series with different intervals can be mixed.
+
+
+
+
+
+
+
+static void reduceFloat(const float *values, int64_t n, AGGREGATE_BUCKET *bucket){
+
+    double sum = 0;
+    uint64_t count = 0;
+    float min = FLT_MAX;
+    float max = -FLT_MAX;
+    int64_t i = 0;
+
+#ifdef __SSE2__
+    __m128d sum_low = _mm_setzero_pd();
+    __m128d sum_high = _mm_setzero_pd();
+    __m128i counts = _mm_setzero_si128();
+    __m128 mins = _mm_set1_ps(FLT_MAX);
+    __m128 maxs = _mm_set1_ps(-FLT_MAX);
+
+    for(; i + 4 <= n; i += 4){
+        __m128 x = _mm_loadu_ps(values + i);
+        __m128 valid = _mm_cmpord_ps(x,x); // all ones where x is not NaN
+
+        __m128 zeroed = _mm_and_ps(x,valid);
+        sum_low = _mm_add_pd(sum_low,_mm_cvtps_pd(zeroed));
+        sum_high = _mm_add_pd(sum_high,_mm_cvtps_pd(_mm_movehl_ps(zeroed,zeroed)));
+
+        counts = _mm_sub_epi32(counts,_mm_castps_si128(valid)); // valid lanes are -1
+
+        mins = _mm_min_ps(mins,_mm_or_ps(_mm_and_ps(valid,x),_mm_andnot_ps(valid,_mm_set1_ps(FLT_MAX))));
+        maxs = _mm_max_ps(maxs,_mm_or_ps(_mm_and_ps(valid,x),_mm_andnot_ps(valid,_mm_set1_ps(-FLT_MAX))));
+    }
+
+    double sums[4];
+    _mm_storeu_pd(sums,sum_low);
+    _mm_storeu_pd(sums + 2,sum_high);
+    sum = sums[0] + sums[1] + sums[2] + sums[3];
+
+    uint32_t lane_counts[4];
+    _mm_storeu_si128((__m128i*)lane_counts,counts);
+    count = (uint64_t)lane_counts[0] + lane_counts[1] + lane_counts[2] + lane_counts[3];
+
+    float lanes[4];
+    _mm_storeu_ps(lanes,mins);
+    for(int lane = 0; lane < 4; lane++)
+        min = lanes[lane] < min ? lanes[lane] : min;
+    _mm_storeu_ps(lanes,maxs);
+    for(int lane = 0; lane < 4; lane++)
+        max = lanes[lane] > max ? lanes[lane] : max;
+#endif
+
+    for(; i < n; i++){
+        float x = values[i];
+        if(x != x)
+            continue;
+        sum += x;
+        count++;
+        min = x < min ? x : min;
+        max = x > max ? x : max;
+    }
+
+    if(!count)
+        return;
+
+    bucket->sum += sum;
+    bucket->count += count;
+    bucket->min = min < bucket->min ? min : bucket->min;
+    bucket->max = max > bucket->max ? max : bucket->max;
+}
+
+
+
+static void reduceByte(const uint8_t *values, int64_t n, uint8_t null_fill, AGGREGATE_BUCKET *bucket){
+
+    uint64_t sum = 0;
+    uint64_t count = 0;
+    uint8_t min = 0xFF;
+    uint8_t max = 0;
+
+    for(int64_t i = 0; i < n; i++){
+        uint8_t x = values[i];
+        if(x == null_fill)
+            continue;
+        sum += x;
+        count++;
+        min = x < min ? x : min;
+        max = x > max ? x : max;
+    }
+
+    if(!count)
+        return;
+
+    bucket->sum += sum;
+    bucket->count += count;
+    bucket->min = min < bucket->min ? min : bucket->min;
+    bucket->max = max > bucket->max ? max : bucket->max;
+}
+
+
+
+
+static void resetBuckets(vector<AGGREGATE_BUCKET> *buckets){
+    for(size_t i = 0; i < buckets->size(); i++){
+        (*buckets)[i].sum = 0;
+        (*buckets)[i].count = 0;
+        (*buckets)[i].min = DBL_MAX;
+        (*buckets)[i].max = -DBL_MAX;
+    }
+}
+
+
+
+
+/// Streams one series into buckets, returns NO_ERROR or the read error
+
+int BSeries::aggregateSeries(uint32_t key, int64_t start_time, int64_t end_time, int64_t bucket_seconds, char *buffer, vector<AGGREGATE_BUCKET> *buckets){
+
+    SERIES header;
+    int status = readHeader(key,&header);
+    if(status != NO_ERROR)
+        return status;
+
+    bool floats = header.datatype == DATATYPE_FLOAT && header.datasize == sizeof(float);
+    bool bytes = header.datatype == DATATYPE_UNSIGNED && header.datasize == sizeof(uint8_t);
+    if(!floats && !bytes)
+        return INVALID_DATATYPE;
+
+    // Nanoseconds, so sub second series line up with the buckets
+    start_time *= NS_PER_SECOND;
+    end_time *= NS_PER_SECOND;
+    int64_t bucket = bucket_seconds * NS_PER_SECOND;
+
+    int64_t interval = header.interval;
+    int64_t chunk_time = (int64_t)write_ahead_size * interval;
+
+    for(int64_t chunk_start = start_time; chunk_start < end_time; chunk_start += chunk_time){
+
+        int64_t chunk_end = chunk_start + chunk_time < end_time ? chunk_start + chunk_time : end_time;
+
+        int64_t n_points = 0, real_points = 0, read_interval = 0, first_point_timestamp = 0;
+        uint32_t datasize = 0;
+        void *result = NULL;
+
+        status = readNs(key,chunk_start,chunk_end,&n_points,&real_points,&read_interval,&first_point_timestamp,&datasize,&result,buffer,write_ahead_size);
+        if(status != NO_ERROR)
+            return status;
+
+        if(!real_points)
+            continue;
+
+        // Cut the block into runs of points in the same bucket, one division per run instead of per point
+        int64_t i = 0;
+        while(i < n_points){
+            int64_t offset = chunk_start + i * interval - start_time;
+            int64_t b = offset / bucket;
+            if(b >= (int64_t)buckets->size())
+                break;
+
+            int64_t run_end = ((b + 1) * bucket - (chunk_start - start_time) + interval - 1) / interval;
+            if(run_end > n_points)
+                run_end = n_points;
+            if(run_end <= i)
+                run_end = i + 1;
+
+            if(datasize == sizeof(float))
+                reduceFloat((float*)buffer + i,run_end - i,&(*buckets)[b]);
+            else
+                reduceByte((uint8_t*)buffer + i,run_end - i,default_null_fill_byte,&(*buckets)[b]);
+
+            i = run_end;
+        }
+    }
+
+    return NO_ERROR;
+}
+
+
+
+void BSeries::aggregateWorker(AGGREGATE_JOB *job){
+
+    {
+        lock_guard<mutex> lock(job->access);
+        if(job->closed)
+            return;
+        job->running++;
+    }
+
+    vector<AGGREGATE_BUCKET> buckets(job->total.size());
+    resetBuckets(&buckets);
+
+    // One block, large enough for the largest datasize we aggregate
+    char *buffer = (char*)malloc((int64_t)write_ahead_size * sizeof(float));
+    if(buffer == NULL){
+        job->failed++;
+    } else {
+        size_t i;
+        while((i = job->next++) < job->n_keys){
+            if(aggregateSeries(job->keys[i],job->start_time,job->end_time,job->bucket_seconds,buffer,&buckets) != NO_ERROR)
+                job->failed++;
+        }
+
+        free(buffer);
+    }
+
+    // Merge into the shared result
+    lock_guard<mutex> lock(job->access);
+    for(size_t b = 0; b < buckets.size(); b++){
+        AGGREGATE_BUCKET *to = &job->total[b];
+        to->sum += buckets[b].sum;
+        to->count += buckets[b].count;
+        to->min = buckets[b].min < to->min ? buckets[b].min : to->min;
+        to->max = buckets[b].max > to->max ? buckets[b].max : to->max;
+    }
+
+    job->running--;
+    job->finished.notify_all();
+}
+
+
+
+
+/// Aggregates many series into one series of buckets, "average of all devices per minute"
+///
+/// op is one of AGGREGATE_SUM, AGGREGATE_AVG, AGGREGATE_MIN, AGGREGATE_MAX, AGGREGATE_COUNT and is applied across every
+/// non null point of every series that falls in a bucket. Empty buckets are NaN (0 for AGGREGATE_COUNT).
+/// result is allocated with new[] and holds n_buckets values, bucket i covers start_time + i * bucket_seconds.
+/// Series that can not be read are skipped and counted in skipped.
+/// The calling thread works through the keys together with up to threads - 1 tasks on read_pool (threads 0 = one per core),
+/// it never waits for a task that has not started, so calling this from a read_pool thread is fine.
+/// Returns NO_ERROR, INVALID_TIME_RANGE, INVALID_AGGREGATE_OP for an unknown op, or -1 while the database is shutting down
+
+int BSeries::readGroupAggregate(const uint32_t *keys, size_t n_keys, int64_t start_time, int64_t end_time, int64_t bucket_seconds, int op, double **result, int64_t *n_buckets, size_t *skipped, unsigned int threads){
+
+    if(shuttingDown)
+        return -1;
+
+    if(op != AGGREGATE_SUM && op != AGGREGATE_AVG && op != AGGREGATE_MIN && op != AGGREGATE_MAX && op != AGGREGATE_COUNT)
+        return INVALID_AGGREGATE_OP;
+
+    if(end_time <= 0)
+        end_time = time(NULL);
+
+    if(start_time <= 0 || start_time >= end_time || bucket_seconds <= 0)
+        return INVALID_TIME_RANGE;
+
+    int64_t buckets = (end_time - start_time + bucket_seconds - 1) / bucket_seconds;
+
+    shared_ptr<AGGREGATE_JOB> job(new AGGREGATE_JOB());
+    job->keys = keys;
+    job->n_keys = n_keys;
+    job->start_time = start_time;
+    job->end_time = end_time;
+    job->bucket_seconds = bucket_seconds;
+    job->total.resize(buckets);
+    resetBuckets(&job->total);
+
+    if(!threads)
+        threads = thread::hardware_concurrency();
+    if(!threads)
+        threads = 1;
+    if(threads > n_keys)
+        threads = n_keys;
+
+    for(unsigned int i = 1; i < threads; i++){
+        if(!read_pool.submit([this,job](){ aggregateWorker(job.get()); }))
+            break;
+    }
+
+    aggregateWorker(job.get()); // This thread is a worker too
+
+    // Tasks still queued find the job closed, wait for the ones that started
+    {
+        unique_lock<mutex> lock(job->access);
+        job->closed = true;
+        job->finished.wait(lock,[&job]{ return job->running == 0; });
+    }
+
+
+    double *output = new double[buckets];
+    for(int64_t b = 0; b < buckets; b++){
+        AGGREGATE_BUCKET *bucket = &job->total[b];
+        switch(op){
+        case AGGREGATE_SUM:   output[b] = bucket->count ? bucket->sum : NAN; break;
+        case AGGREGATE_AVG:   output[b] = bucket->count ? bucket->sum / bucket->count : NAN; break;
+        case AGGREGATE_MIN:   output[b] = bucket->count ? bucket->min : NAN; break;
+        case AGGREGATE_MAX:   output[b] = bucket->count ? bucket->max : NAN; break;
+        case AGGREGATE_COUNT: output[b] = bucket->count; break;
+        }
+    }
+
+    *result = output;
+    *n_buckets = buckets;
+    if(skipped)
+        *skipped = job->failed;
+
+    return NO_ERROR;
+}
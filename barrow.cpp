@@ -0,0 +1,558 @@
+#include "barrow.h"
+
+#include <string.h>
+#include <algorithm>
+
+
+
+// Flatbuffer and Arrow constants used below (Message.fbs, Schema.fbs)
+
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_FLOATING_POINT 3
+#define ARROW_TYPE_TIMESTAMP 10
+#define ARROW_TYPE_FIXED_SIZE_BINARY 15
+#define ARROW_PRECISION_SINGLE 1
+
+#define ARROW_CONTINUATION 0xFFFFFFFF
+
+
+
+
+typedef struct
+{
+     int id;
+     int size; // 1, 2, 4 or 8 bytes
+     uint64_t value; // ignored for offsets
+     bool offset; // uoffset to an object written later, set with link()
+} FB_FIELD;
+
+
+typedef struct
+{
+     int64_t length;
+     int64_t null_count;
+} ARROW_FIELD_NODE;
+
+
+typedef struct
+{
+     int64_t offset;
+     int64_t length;
+} ARROW_BUFFER;
+
+
+
+
+/// Builds a flatbuffer front to back, every object is written after the object referring to it so all offsets point forward.
+/// Tables start on 8 bytes with their vtable right before them
+
+class FlatBuilder
+{
+public:
+    FlatBuilder() { data.append(4,0); } // Root offset
+
+    void pad(size_t alignment){
+        while(data.size() % alignment)
+            data.push_back(0);
+    }
+
+    void link(size_t at, size_t target){
+        uint32_t offset = target - at;
+        memcpy(&data[at],&offset,sizeof(offset));
+    }
+
+    // positions[id] is set to where each field was written
+    size_t table(std::vector<FB_FIELD> fields, size_t *positions){
+
+        int n = 0;
+        for(size_t i = 0; i < fields.size(); i++)
+            n = fields[i].id + 1 > n ? fields[i].id + 1 : n;
+
+        std::stable_sort(fields.begin(),fields.end(),[](const FB_FIELD &a, const FB_FIELD &b){ return a.size > b.size; });
+
+        std::vector<uint16_t> offsets(n,0);
+        size_t cursor = 4; // soffset to the vtable
+        for(size_t i = 0; i < fields.size(); i++){
+            cursor = (cursor + fields[i].size - 1) / fields[i].size * fields[i].size;
+            offsets[fields[i].id] = cursor;
+            cursor += fields[i].size;
+        }
+
+        pad(2);
+        size_t vtable = data.size();
+        uint16_t vtable_size = 4 + 2 * n;
+        uint16_t table_size = cursor;
+        data.append((const char*)&vtable_size,2);
+        data.append((const char*)&table_size,2);
+        data.append((const char*)offsets.data(),2 * n);
+
+        pad(8);
+        size_t table = data.size();
+        int32_t soffset = table - vtable;
+        data.append((const char*)&soffset,4);
+        data.append(cursor - 4,0);
+
+        for(size_t i = 0; i < fields.size(); i++){
+            size_t at = table + offsets[fields[i].id];
+            if(!fields[i].offset)
+                memcpy(&data[at],&fields[i].value,fields[i].size); // little endian
+            positions[fields[i].id] = at;
+        }
+
+        return table;
+    }
+
+    size_t structs(const void *elements, uint32_t count, size_t element_size, size_t alignment){
+        while((data.size() + 4) % alignment)
+            data.push_back(0);
+        size_t at = data.size();
+        data.append((const char*)&count,4);
+        data.append((const char*)elements,count * element_size);
+        return at;
+    }
+
+    // Vector of offsets, element i is at the returned position + 4 + 4 * i
+    size_t offsets(uint32_t count){
+        pad(4);
+        size_t at = data.size();
+        data.append((const char*)&count,4);
+        data.append(4 * count,0);
+        return at;
+    }
+
+    size_t string(const std::string &s){
+        pad(4);
+        size_t at = data.size();
+        uint32_t length = s.size();
+        data.append((const char*)&length,4);
+        data.append(s);
+        data.push_back(0);
+        return at;
+    }
+
+    std::string data;
+};
+
+
+
+
+/// Bounds checked flatbuffer access, any read out of range clears ok and returns 0
+
+class FlatReader
+{
+public:
+    FlatReader(const std::string &buffer) : data(buffer), ok(true) {}
+
+    template <class T> T scalar(size_t at){
+        T value = 0;
+        if(at + sizeof(T) > data.size() || at + sizeof(T) < at){
+            ok = false;
+            return value;
+        }
+        memcpy(&value,&data[at],sizeof(T));
+        return value;
+    }
+
+    size_t root(){ return scalar<uint32_t>(0); }
+
+    size_t follow(size_t at){ return at ? at + scalar<uint32_t>(at) : 0; }
+
+    size_t field(size_t table, int id){
+        if(!table)
+            return 0;
+        size_t vtable = table - (int64_t)scalar<int32_t>(table);
+        uint16_t size = scalar<uint16_t>(vtable);
+        if(4 + 2 * id >= size)
+            return 0;
+        uint16_t offset = scalar<uint16_t>(vtable + 4 + 2 * id);
+        return offset ? table + offset : 0;
+    }
+
+    template <class T> T get(size_t table, int id, T otherwise){
+        size_t at = field(table,id);
+        return at ? scalar<T>(at) : otherwise;
+    }
+
+    size_t child(size_t table, int id){ return follow(field(table,id)); }
+
+    std::string string(size_t at){
+        if(!at)
+            return std::string();
+        uint32_t length = scalar<uint32_t>(at);
+        if(!ok || at + 4 + length > data.size()){
+            ok = false;
+            return std::string();
+        }
+        return data.substr(at + 4,length);
+    }
+
+    const std::string &data;
+    bool ok;
+};
+
+
+
+
+static void padTo8(std::string *s){
+    while(s->size() % 8)
+        s->push_back(0);
+}
+
+
+
+
+BArrowWriter::BArrowWriter()
+{
+    out = NULL;
+    datasize = 0;
+}
+
+
+BArrowWriter::~BArrowWriter()
+{
+    if(out)
+        fclose(out);
+}
+
+
+
+
+bool BArrowWriter::writeMessage(const std::string &metadata, const std::string &body){
+
+    std::string padded = metadata;
+    padTo8(&padded);
+
+    uint32_t continuation = ARROW_CONTINUATION;
+    int32_t length = padded.size();
+
+    return fwrite(&continuation,4,1,out) == 1 && fwrite(&length,4,1,out) == 1 &&
+           fwrite(padded.data(),1,padded.size(),out) == padded.size() &&
+           fwrite(body.data(),1,body.size(),out) == body.size();
+}
+
+
+
+
+bool BArrowWriter::open(const char *filename, int value_type, uint32_t datasize, const std::vector< std::pair<std::string,std::string> > &metadata, int timestamp_unit){
+
+    out = fopen(filename,"wb");
+    if(out == NULL)
+        return false;
+
+    this->datasize = datasize;
+
+    FlatBuilder fb;
+    size_t p[8];
+
+    size_t message = fb.table({{0,2,ARROW_METADATA_V5,false},{1,1,ARROW_HEADER_SCHEMA,false},{2,4,0,true},{3,8,0,false}},p);
+    fb.link(0,message);
+    size_t header_at = p[2];
+
+    size_t schema = fb.table({{0,2,0,false},{1,4,0,true},{2,4,0,true}},p); // little endian
+    fb.link(header_at,schema);
+    size_t fields_at = p[1];
+    size_t metadata_at = p[2];
+
+    size_t fields = fb.offsets(2);
+    fb.link(fields_at,fields);
+
+    for(int i = 0; i < 2; i++){
+        uint8_t type;
+        if(i == 0)
+            type = ARROW_TYPE_TIMESTAMP;
+        else if(value_type == ARROW_VALUE_FLOAT && datasize == 4)
+            type = ARROW_TYPE_FLOATING_POINT;
+        else if(value_type == ARROW_VALUE_UINT8 && datasize == 1)
+            type = ARROW_TYPE_INT;
+        else
+            type = ARROW_TYPE_FIXED_SIZE_BINARY;
+
+        size_t field = fb.table({{0,4,0,true},{1,1,0,false},{2,1,type,false},{3,4,0,true},{5,4,0,true}},p);
+        fb.link(fields + 4 + 4 * i,field);
+        size_t name_at = p[0], type_at = p[3], children_at = p[5];
+
+        fb.link(name_at,fb.string(i == 0 ? "timestamp" : "value"));
+
+        size_t type_table;
+        if(type == ARROW_TYPE_TIMESTAMP)
+            type_table = fb.table({{0,2,(uint64_t)timestamp_unit,false}},p);
+        else if(type == ARROW_TYPE_FLOATING_POINT)
+            type_table = fb.table({{0,2,ARROW_PRECISION_SINGLE,false}},p);
+        else if(type == ARROW_TYPE_INT)
+            type_table = fb.table({{0,4,8,false},{1,1,0,false}},p);
+        else
+            type_table = fb.table({{0,4,datasize,false}},p);
+        fb.link(type_at,type_table);
+
+        fb.link(children_at,fb.structs(NULL,0,4,4));
+    }
+
+    size_t pairs = fb.offsets(metadata.size());
+    fb.link(metadata_at,pairs);
+
+    for(size_t i = 0; i < metadata.size(); i++){
+        size_t pair = fb.table({{0,4,0,true},{1,4,0,true}},p);
+        fb.link(pairs + 4 + 4 * i,pair);
+        size_t key_at = p[0], value_at = p[1];
+        fb.link(key_at,fb.string(metadata[i].first));
+        fb.link(value_at,fb.string(metadata[i].second));
+    }
+
+    if(!writeMessage(fb.data,std::string())){
+        fclose(out);
+        out = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+
+
+
+/// One record batch of n_rows rows, values holds n_rows * datasize bytes
+
+bool BArrowWriter::write(const int64_t *timestamps, const char *values, int64_t n_rows){
+
+    if(out == NULL)
+        return false;
+
+    if(n_rows <= 0)
+        return true;
+
+    std::string body((const char*)timestamps,n_rows * 8);
+    int64_t values_offset = body.size();
+    body.append(values,n_rows * datasize);
+    padTo8(&body);
+
+    ARROW_FIELD_NODE nodes[2] = {{n_rows,0},{n_rows,0}};
+    ARROW_BUFFER buffers[4] = {{0,0},{0,n_rows * 8},{values_offset,0},{values_offset,n_rows * (int64_t)datasize}}; // validity, data per column
+
+    FlatBuilder fb;
+    size_t p[8];
+
+    size_t message = fb.table({{0,2,ARROW_METADATA_V5,false},{1,1,ARROW_HEADER_RECORD_BATCH,false},{2,4,0,true},{3,8,body.size(),false}},p);
+    fb.link(0,message);
+    size_t header_at = p[2];
+
+    size_t batch = fb.table({{0,8,(uint64_t)n_rows,false},{1,4,0,true},{2,4,0,true}},p);
+    fb.link(header_at,batch);
+    size_t nodes_at = p[1], buffers_at = p[2];
+
+    fb.link(nodes_at,fb.structs(nodes,2,sizeof(ARROW_FIELD_NODE),8));
+    fb.link(buffers_at,fb.structs(buffers,4,sizeof(ARROW_BUFFER),8));
+
+    return writeMessage(fb.data,body);
+}
+
+
+
+
+bool BArrowWriter::close(){
+
+    if(out == NULL)
+        return false;
+
+    uint32_t end[2] = {ARROW_CONTINUATION,0};
+    bool success = fwrite(end,4,2,out) == 2;
+    success = fclose(out) == 0 && success;
+    out = NULL;
+
+    return success;
+}
+
+
+
+
+BArrowReader::BArrowReader()
+{
+    in = NULL;
+    value_type = ARROW_VALUE_BINARY;
+    datasize = 0;
+    timestamp_unit = ARROW_UNIT_SECOND;
+}
+
+
+BArrowReader::~BArrowReader()
+{
+    close();
+}
+
+
+void BArrowReader::close(){
+    if(in)
+        fclose(in);
+    in = NULL;
+}
+
+
+
+
+/// Reads the next message and its body. Returns 1 for a message, 0 at the end of stream marker (a 0 length, after the
+/// continuation or on its own as older writers did) and -1 on an error or when the file ends anywhere else (truncated)
+
+int BArrowReader::readMessage(std::string *metadata, std::string *body){
+
+    uint32_t length;
+    if(fread(&length,4,1,in) != 1)
+        return -1;
+    if(length == ARROW_CONTINUATION && fread(&length,4,1,in) != 1)
+        return -1;
+    if(length == 0)
+        return 0;
+    if(length > (1 << 30))
+        return -1;
+
+    metadata->resize(length);
+    if(fread(&(*metadata)[0],1,length,in) != length)
+        return -1;
+
+    FlatReader fr(*metadata);
+    int64_t body_length = fr.get<int64_t>(fr.root(),3,0);
+    if(!fr.ok || body_length < 0 || body_length > ((int64_t)1 << 40))
+        return -1;
+
+    body->resize(body_length);
+    if(body_length && fread(&(*body)[0],1,body_length,in) != (size_t)body_length)
+        return -1;
+
+    return 1;
+}
+
+
+
+
+bool BArrowReader::open(const char *filename){
+
+    in = fopen(filename,"rb");
+    if(in == NULL)
+        return false;
+
+    std::string message, body;
+    if(readMessage(&message,&body) != 1){
+        close();
+        return false;
+    }
+
+    FlatReader fr(message);
+    size_t root = fr.root();
+    if(fr.get<uint8_t>(root,1,0) != ARROW_HEADER_SCHEMA){
+        close();
+        return false;
+    }
+
+    size_t schema = fr.child(root,2);
+    size_t fields = fr.child(schema,1);
+    if(fr.scalar<uint32_t>(fields) != 2){
+        close();
+        return false;
+    }
+
+    // timestamp or int64, then float32, uint8 or fixed_size_binary
+    size_t timestamp = fr.follow(fields + 4);
+    size_t value = fr.follow(fields + 8);
+
+    uint8_t timestamp_type = fr.get<uint8_t>(timestamp,2,0);
+    size_t timestamp_table = fr.child(timestamp,3);
+    timestamp_unit = timestamp_type == ARROW_TYPE_TIMESTAMP ? fr.get<int16_t>(timestamp_table,0,ARROW_UNIT_SECOND) : ARROW_UNIT_SECOND;
+    bool timestamp_valid = (timestamp_type == ARROW_TYPE_TIMESTAMP && timestamp_unit >= ARROW_UNIT_SECOND && timestamp_unit <= ARROW_UNIT_NANOSECOND) ||
+                           (timestamp_type == ARROW_TYPE_INT && fr.get<int32_t>(timestamp_table,0,0) == 64);
+
+    uint8_t value_arrow_type = fr.get<uint8_t>(value,2,0);
+    size_t value_table = fr.child(value,3);
+    datasize = 0;
+    if(value_arrow_type == ARROW_TYPE_FLOATING_POINT && fr.get<int16_t>(value_table,0,0) == ARROW_PRECISION_SINGLE){
+        value_type = ARROW_VALUE_FLOAT;
+        datasize = 4;
+    } else if(value_arrow_type == ARROW_TYPE_INT && fr.get<int32_t>(value_table,0,0) == 8){
+        value_type = ARROW_VALUE_UINT8;
+        datasize = 1;
+    } else if(value_arrow_type == ARROW_TYPE_FIXED_SIZE_BINARY){
+        value_type = ARROW_VALUE_BINARY;
+        datasize = fr.get<int32_t>(value_table,0,0);
+    }
+
+    metadata.clear();
+    size_t pairs = fr.child(schema,2);
+    uint32_t n_pairs = pairs ? fr.scalar<uint32_t>(pairs) : 0;
+    for(uint32_t i = 0; fr.ok && i < n_pairs; i++){
+        size_t pair = fr.follow(pairs + 4 + 4 * i);
+        metadata.push_back(std::make_pair(fr.string(fr.child(pair,0)),fr.string(fr.child(pair,1))));
+    }
+
+    if(!fr.ok || !timestamp_valid || datasize == 0){
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+
+
+
+int64_t BArrowReader::next(std::vector<int64_t> *timestamps, std::string *values){
+
+    timestamps->clear();
+    values->clear();
+
+    if(in == NULL)
+        return -1;
+
+    std::string message, body;
+
+    while(true){
+        int status = readMessage(&message,&body);
+        if(status <= 0)
+            return status; // 0 only at the end of stream marker, a stream cut short is an error
+
+        FlatReader fr(message);
+        size_t root = fr.root();
+        if(fr.get<uint8_t>(root,1,0) != ARROW_HEADER_RECORD_BATCH)
+            continue; // Not a batch (dictionaries are not used by this layout)
+
+        size_t batch = fr.child(root,2);
+        int64_t rows = fr.get<int64_t>(batch,0,0);
+
+        if(fr.field(batch,3)) // Compressed bodies are not supported
+            return -1;
+
+        size_t buffers = fr.child(batch,2);
+        if(!fr.ok || rows < 0 || fr.scalar<uint32_t>(buffers) < 4)
+            return -1;
+
+        ARROW_BUFFER b[4];
+        for(int i = 0; i < 4; i++){
+            b[i].offset = fr.scalar<int64_t>(buffers + 4 + 16 * i);
+            b[i].length = fr.scalar<int64_t>(buffers + 4 + 16 * i + 8);
+        }
+
+        for(int i = 1; i < 4; i++){
+            if(b[i].offset < 0 || b[i].length < 0 || b[i].offset + b[i].length > (int64_t)body.size())
+                return -1;
+        }
+        if(!fr.ok || b[1].length < rows * 8 || b[3].length < rows * (int64_t)datasize || (b[2].length && b[2].length < (rows + 7) / 8))
+            return -1;
+
+        const int64_t *ts = (const int64_t*)(body.data() + b[1].offset);
+        const uint8_t *valid = b[2].length ? (const uint8_t*)(body.data() + b[2].offset) : NULL;
+        const char *data = body.data() + b[3].offset;
+
+        for(int64_t r = 0; r < rows; r++){
+            if(valid != NULL && !(valid[r / 8] & (1 << (r % 8))))
+                continue;
+            int64_t t;
+            memcpy(&t,ts + r,sizeof(t));
+            timestamps->push_back(t);
+            values->append(data + r * datasize,datasize);
+        }
+
+        if(timestamps->empty()) // Every row was null
+            continue;
+
+        return timestamps->size();
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef BARROW_H
+#define BARROW_H
+
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+
+
+#define ARROW_VALUE_FLOAT 0 // float32, datasize 4
+#define ARROW_VALUE_UINT8 1 // uint8, datasize 1
+#define ARROW_VALUE_BINARY 2 // fixed size binary of any datasize
+
+#define ARROW_UNIT_SECOND 0
+#define ARROW_UNIT_MILLISECOND 1
+#define ARROW_UNIT_MICROSECOND 2
+#define ARROW_UNIT_NANOSECOND 3
+
+
+
+
+/// Minimal Arrow IPC stream writer
+///
+/// Writes the Arrow streaming format (schema message, one record batch per write, end of stream marker) for a table of
+/// two non null columns: timestamp (timestamp[s] to timestamp[ns]) and value (float32, uint8 or fixed_size_binary).
+/// The flatbuffer metadata is built by hand so there is no dependency on the Arrow libraries, the output can be read
+/// by any Arrow implementation (pyarrow.ipc.open_stream, arrow::ipc::RecordBatchStreamReader, ...).
+/// Key/value metadata is stored as schema custom metadata.
+
+class BArrowWriter
+{
+public:
+    BArrowWriter();
+    ~BArrowWriter();
+
+    bool open(const char *filename, int value_type, uint32_t datasize, const std::vector< std::pair<std::string,std::string> > &metadata, int timestamp_unit = ARROW_UNIT_SECOND);
+    bool write(const int64_t *timestamps, const char *values, int64_t n_rows);
+    bool close(); // writes the end of stream marker
+
+private:
+    bool writeMessage(const std::string &metadata, const std::string &body);
+
+    FILE *out;
+    uint32_t datasize;
+};
+
+
+
+
+/// Reads streams written by BArrowWriter, and streams of the same two column layout written by other Arrow
+/// implementations (no compression, no dictionaries). Rows with a null value are dropped, timestamps are in timestamp_unit
+/// (plain int64 timestamp columns are taken as seconds)
+
+class BArrowReader
+{
+public:
+    BArrowReader();
+    ~BArrowReader();
+
+    bool open(const char *filename); // reads the schema
+    int64_t next(std::vector<int64_t> *timestamps, std::string *values); // rows of the next batch, 0 at the end of stream marker, -1 on error or truncation
+    void close();
+
+    std::vector< std::pair<std::string,std::string> > metadata;
+    int value_type;
+    uint32_t datasize;
+    int timestamp_unit;
+
+private:
+    int readMessage(std::string *metadata, std::string *body);
+
+    FILE *in;
+};
+
+
+#endif // BARROW_H
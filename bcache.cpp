@@ -0,0 +1,189 @@
+#include "bcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+
+
+BReadCache::BReadCache()
+{
+    for(int i = 0; i < READ_CACHE_STRIPES; i++){
+        stripes[i].bytes = 0;
+        stripes[i].generation = 0;
+    }
+
+    capacity = 0;
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+    bytes_saved = 0;
+}
+
+
+BReadCache::~BReadCache()
+{
+    clear();
+}
+
+
+
+
+CACHE_STRIPE* BReadCache::stripeFor(uint32_t key){
+    return &stripes[(key * 2654435761u) % READ_CACHE_STRIPES];
+}
+
+
+
+// Drops least recently used blocks until the stripe is within limit, stripe must be locked
+
+void BReadCache::evict(CACHE_STRIPE *stripe, int64_t limit){
+
+    while(stripe->bytes > limit && !stripe->lru.empty()){
+        CACHED_BLOCK &oldest = stripe->lru.back();
+        stripe->bytes -= oldest.bytes;
+        stripe->index.erase(oldest.id);
+        free(oldest.data);
+        stripe->lru.pop_back();
+        evictions++;
+    }
+}
+
+
+
+
+void BReadCache::setCapacity(int64_t bytes){
+
+    capacity = bytes;
+
+    for(int i = 0; i < READ_CACHE_STRIPES; i++){
+        std::lock_guard<std::mutex> lock(stripes[i].access);
+        evict(&stripes[i],bytes / READ_CACHE_STRIPES);
+    }
+}
+
+
+
+
+bool BReadCache::get(uint32_t key, int64_t block, char *output, int64_t offset, int64_t bytes){
+
+    if(capacity <= 0)
+        return false;
+
+    uint64_t id = ((uint64_t)key << 32) | (uint32_t)block;
+    CACHE_STRIPE *stripe = stripeFor(key);
+
+    std::lock_guard<std::mutex> lock(stripe->access);
+
+    auto found = stripe->index.find(id);
+    if(found == stripe->index.end() || offset + bytes > found->second->bytes){
+        misses++;
+        return false;
+    }
+
+    stripe->lru.splice(stripe->lru.begin(),stripe->lru,found->second); // Most recently used
+    memcpy(output,found->second->data + offset,bytes);
+
+    hits++;
+    bytes_saved += bytes;
+    return true;
+}
+
+
+
+
+uint64_t BReadCache::generation(uint32_t key){
+    return stripeFor(key)->generation.load();
+}
+
+
+
+
+void BReadCache::put(uint32_t key, int64_t block, const char *data, int64_t bytes, uint64_t generation){
+
+    int64_t limit = capacity / READ_CACHE_STRIPES;
+    if(bytes > limit)
+        return;
+
+    CACHED_BLOCK cached;
+    cached.id = ((uint64_t)key << 32) | (uint32_t)block;
+    cached.bytes = bytes;
+    cached.data = (char*)malloc(bytes);
+    if(cached.data == NULL)
+        return;
+    memcpy(cached.data,data,bytes);
+
+    CACHE_STRIPE *stripe = stripeFor(key);
+    std::lock_guard<std::mutex> lock(stripe->access);
+
+    if(generation != READ_CACHE_ANY_GENERATION && generation != stripe->generation){ // Read before a direct write, may be stale
+        free(cached.data);
+        return;
+    }
+
+    auto found = stripe->index.find(cached.id);
+    if(found != stripe->index.end()){ // Raced with another reader, keep theirs
+        free(cached.data);
+        return;
+    }
+
+    stripe->lru.push_front(cached);
+    stripe->index[cached.id] = stripe->lru.begin();
+    stripe->bytes += bytes;
+
+    evict(stripe,limit);
+}
+
+
+
+
+void BReadCache::invalidate(uint32_t key, int64_t first_block, int64_t last_block){
+
+    CACHE_STRIPE *stripe = stripeFor(key);
+    std::lock_guard<std::mutex> lock(stripe->access);
+
+    // Also while disabled, a read that started before setCapacity() must not put a block this write made stale
+    stripe->generation++;
+
+    if(capacity <= 0)
+        return;
+
+    for(int64_t block = first_block; block <= last_block; block++){
+        auto found = stripe->index.find(((uint64_t)key << 32) | (uint32_t)block);
+        if(found == stripe->index.end())
+            continue;
+
+        stripe->bytes -= found->second->bytes;
+        free(found->second->data);
+        stripe->lru.erase(found->second);
+        stripe->index.erase(found);
+    }
+}
+
+
+
+
+void BReadCache::clear(){
+
+    for(int i = 0; i < READ_CACHE_STRIPES; i++){
+        std::lock_guard<std::mutex> lock(stripes[i].access);
+        for(auto it = stripes[i].lru.begin(); it != stripes[i].lru.end(); it++)
+            free(it->data);
+        stripes[i].lru.clear();
+        stripes[i].index.clear();
+        stripes[i].bytes = 0;
+    }
+}
+
+
+
+
+int64_t BReadCache::size(){
+
+    int64_t bytes = 0;
+    for(int i = 0; i < READ_CACHE_STRIPES; i++){
+        std::lock_guard<std::mutex> lock(stripes[i].access);
+        bytes += stripes[i].bytes;
+    }
+    return bytes;
+}
@@ -0,0 +1,80 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+
+
+#include <stdint.h>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+
+
+#define READ_CACHE_STRIPES 16
+#define READ_CACHE_ANY_GENERATION UINT64_MAX
+
+
+
+typedef struct
+{
+     uint64_t id; // key << 32 | block
+     char *data;
+     int64_t bytes;
+} CACHED_BLOCK;
+
+
+typedef struct
+{
+     std::mutex access;
+     std::list<CACHED_BLOCK> lru; // most recently used first
+     std::unordered_map< uint64_t, std::list<CACHED_BLOCK>::iterator > index;
+     int64_t bytes;
+     std::atomic<uint64_t> generation; // bumped by every invalidate
+} CACHE_STRIPE;
+
+
+
+
+/// Read cache for sealed blocks
+///
+/// Holds whole blocks of flushed data keyed by (key, block), blocks are the same write_ahead_size * datasize
+/// blocks used by the checksums. Only complete blocks are cached, those can only change through a direct write
+/// which invalidates them. Memory is bounded by capacity, least recently used blocks are evicted first.
+/// Keys are spread over stripes so concurrent readers of different keys do not share a lock
+
+class BReadCache
+{
+public:
+    BReadCache();
+    ~BReadCache();
+
+    void setCapacity(int64_t bytes); // 0 disables the cache and drops everything
+    bool enabled() { return capacity > 0; }
+
+    // Copies bytes starting at offset within the block to output, returns false on a miss
+    bool get(uint32_t key, int64_t block, char *output, int64_t offset, int64_t bytes);
+    // With a generation from generation(key) taken before the block was read, the block is dropped if it was invalidated since
+    void put(uint32_t key, int64_t block, const char *data, int64_t bytes, uint64_t generation = READ_CACHE_ANY_GENERATION);
+    uint64_t generation(uint32_t key);
+
+    void invalidate(uint32_t key, int64_t first_block, int64_t last_block);
+    void clear();
+
+    int64_t size();
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> evictions;
+    std::atomic<uint64_t> bytes_saved; // bytes returned from the cache instead of read from disk
+
+private:
+    CACHE_STRIPE* stripeFor(uint32_t key);
+    void evict(CACHE_STRIPE *stripe, int64_t limit);
+
+    CACHE_STRIPE stripes[READ_CACHE_STRIPES];
+    std::atomic<int64_t> capacity;
+};
+
+
+#endif // BCACHE_H
@@ -0,0 +1,461 @@
+#include "bseries.h"
+#include "debug.h"
+#include "crc32c.h"
+
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+
+
+
+
+/// Block checksums
+///
+/// Data files only ever grow by appending (flushBuffer and null fill), so the crc of the
+/// partial last block is continued from its stored value and appends never read back from disk.
+/// Direct writes modify a sealed block in place, the block is only marked stale and its crc is recomputed once
+/// (read back from the file) at the next flush, verified read or scrub of the series, or when CHECKSUM_MAX_STALE
+/// blocks are waiting, so a backfill of many points into one block reads that block once.
+
+
+
+
+BFile* BSeries::openChecksumFile(uint32_t key, bool writeMode){
+
+    char filename[256];
+    sprintf(filename,"%s/%u.crc",data_directory,key);
+
+    return io->open(filename,writeMode);
+}
+
+
+
+
+/// Checks that the sidecar describes data_bytes of data, rebuilds it from the data file if it dose not
+/// (new series, files written before checksums were enabled, crash between data and sidecar write).
+/// Only a missing sidecar, a bad sidecar header or a sidecar of the wrong length is rebuilt, a crc that does not match
+/// its block (the last one included) is corruption and is left for reads and the scrubber to report
+
+bool BSeries::validateChecksums(uint32_t key, ENTRY *series, BFile *file, int64_t data_bytes){
+
+    if(series->checksums_checked)
+        return true;
+
+    int64_t block_bytes = (int64_t)write_ahead_size * series->header.datasize;
+    int64_t blocks = (data_bytes + block_bytes - 1) / block_bytes;
+
+    BFile *checksums = openChecksumFile(key,false);
+
+    bool valid = false;
+    if(checksums != NULL){
+        CHECKSUM_HEADER header;
+        if(checksums->read(&header,sizeof(header),0) == sizeof(header) &&
+           header.magic == CHECKSUM_MAGIC && header.block_bytes == block_bytes &&
+           checksums->size() == (int64_t)sizeof(header) + blocks * (int64_t)sizeof(uint32_t)){
+            valid = true;
+        }
+
+        delete checksums;
+    }
+
+    if(!valid){
+        if(data_bytes > 0)
+            _WARN("\t Rebuilding block checksums for series %u\n",key);
+        if(!rebuildChecksums(key,series,file,data_bytes))
+            return false;
+    }
+
+    series->checksums_checked = true;
+    return true;
+}
+
+
+
+
+bool BSeries::rebuildChecksums(uint32_t key, ENTRY *series, BFile *file, int64_t data_bytes){
+
+    char filename[256];
+    sprintf(filename,"%s/%u.crc",data_directory,key);
+    unlink(filename);
+
+    BFile *checksums = openChecksumFile(key,true);
+    if(checksums == NULL){
+        _ERROR("\t Failed to create checksum file for series %u\n",key);
+        return false;
+    }
+
+    int64_t block_bytes = (int64_t)write_ahead_size * series->header.datasize;
+
+    CHECKSUM_HEADER header;
+    header.magic = CHECKSUM_MAGIC;
+    header.block_bytes = block_bytes;
+
+    bool success = checksums->write(&header,sizeof(header),0) == sizeof(header);
+
+    char *buffer = (char*)malloc(block_bytes);
+    if(buffer == NULL)
+        success = false;
+
+    for(int64_t block = 0; success && block * block_bytes < data_bytes; block++){
+        int64_t size = data_bytes - block * block_bytes;
+        if(size > block_bytes)
+            size = block_bytes;
+
+        if(file->read(buffer,size,series->header_size + block * block_bytes) != size){
+            success = false;
+            break;
+        }
+
+        uint32_t crc = crc32c(0,buffer,size);
+        success = checksums->write(&crc,sizeof(crc),sizeof(header) + block * sizeof(uint32_t)) == sizeof(crc);
+    }
+
+    free(buffer);
+    delete checksums;
+
+    return success;
+}
+
+
+
+
+/// Continues the checksums over bytes of data appended at file offset
+
+void BSeries::appendChecksums(uint32_t key, ENTRY *series, BFile *file, const char *data, int64_t offset, int64_t bytes){
+
+    if(!block_checksums || bytes <= 0)
+        return;
+
+    int64_t data_offset = offset - series->header_size;
+
+    settleChecksums(key,series,file); // The partial last block may have been rewritten
+
+    if(!validateChecksums(key,series,file,data_offset))
+        return;
+
+    BFile *checksums = openChecksumFile(key,true);
+    if(checksums == NULL){
+        _ERROR("\t Failed to open checksum file for series %u\n",key);
+        series->checksums_checked = false; // Rebuilt on the next append
+        return;
+    }
+
+    int64_t block_bytes = (int64_t)write_ahead_size * series->header.datasize;
+    int64_t first_block = data_offset / block_bytes;
+    int64_t last_block = (data_offset + bytes - 1) / block_bytes;
+
+    vector<uint32_t> crcs(last_block - first_block + 1);
+
+    uint32_t crc = 0;
+    if(data_offset % block_bytes){ // Continue the partial block
+        if(checksums->read(&crc,sizeof(crc),sizeof(CHECKSUM_HEADER) + first_block * sizeof(uint32_t)) != sizeof(crc)){
+            delete checksums;
+            series->checksums_checked = false;
+            return;
+        }
+    }
+
+    int64_t position = data_offset;
+    int64_t done = 0;
+    for(int64_t block = first_block; block <= last_block; block++){
+        int64_t in_block = position % block_bytes;
+        int64_t size = block_bytes - in_block;
+        if(size > bytes - done)
+            size = bytes - done;
+
+        crcs[block - first_block] = crc32c(in_block ? crc : 0,data + done,size);
+
+        position += size;
+        done += size;
+    }
+
+    int64_t size = crcs.size() * sizeof(uint32_t);
+    if(checksums->write(crcs.data(),size,sizeof(CHECKSUM_HEADER) + first_block * sizeof(uint32_t)) != size){
+        _ERROR("\t Failed to write block checksums for series %u\n",key);
+        series->checksums_checked = false;
+    }
+
+    delete checksums;
+}
+
+
+
+
+/// Marks the blocks holding bytes overwritten in place at file offset as stale
+
+void BSeries::rewriteChecksums(uint32_t key, ENTRY *series, BFile *file, int64_t offset, int64_t bytes){
+
+    if(!block_checksums || bytes <= 0)
+        return;
+
+    int64_t block_bytes = (int64_t)write_ahead_size * series->header.datasize;
+    int64_t data_offset = offset - series->header_size;
+
+    for(int64_t block = data_offset / block_bytes; block <= (data_offset + bytes - 1) / block_bytes; block++)
+        series->checksums_stale.insert(block);
+
+    if(series->checksums_stale.size() >= CHECKSUM_MAX_STALE)
+        settleChecksums(key,series,file);
+}
+
+
+
+
+/// Recomputes the checksums of the stale blocks from the data file, series must be locked
+
+void BSeries::settleChecksums(uint32_t key, ENTRY *series, BFile *file){
+
+    if(series->checksums_stale.empty())
+        return;
+
+    set<int64_t> stale;
+    stale.swap(series->checksums_stale);
+
+    if(!block_checksums)
+        return;
+
+    int64_t data_bytes = series->file_size - series->header_size;
+
+    if(!validateChecksums(key,series,file,data_bytes)) // Rebuilding also picks up these writes
+        return;
+
+    BFile *checksums = openChecksumFile(key,true);
+    if(checksums == NULL){
+        series->checksums_checked = false;
+        return;
+    }
+
+    int64_t block_bytes = (int64_t)write_ahead_size * series->header.datasize;
+
+    char *buffer = (char*)malloc(block_bytes);
+
+    for(auto it = stale.begin(); buffer != NULL && it != stale.end(); it++){
+        int64_t block = *it;
+        int64_t size = data_bytes - block * block_bytes;
+        if(size > block_bytes)
+            size = block_bytes;
+
+        if(file->read(buffer,size,series->header_size + block * block_bytes) != size){
+            series->checksums_checked = false;
+            break;
+        }
+
+        uint32_t crc = crc32c(0,buffer,size);
+        if(checksums->write(&crc,sizeof(crc),sizeof(CHECKSUM_HEADER) + block * sizeof(uint32_t)) != sizeof(crc)){
+            series->checksums_checked = false;
+            break;
+        }
+    }
+
+    free(buffer);
+    delete checksums;
+}
+
+
+
+
+/// Reads a block into buffer and verifies it against the sidecar
+/// Returns 1 if valid, 0 on mismatch, -1 if the block has no checksum or could not be read
+
+int BSeries::checkBlock(BFile *file, BFile *checksums, int64_t header_size, uint32_t datasize, int64_t data_bytes, int64_t block, char *buffer, int64_t *block_size){
+
+    int64_t block_bytes = (int64_t)write_ahead_size * datasize;
+
+    int64_t size = data_bytes - block * block_bytes;
+    if(size > block_bytes)
+        size = block_bytes;
+    if(size <= 0)
+        return -1;
+
+    uint32_t expected;
+    if(checksums->read(&expected,sizeof(expected),sizeof(CHECKSUM_HEADER) + block * sizeof(uint32_t)) != sizeof(expected))
+        return -1;
+
+    if(file->read(buffer,size,header_size + block * block_bytes) != size)
+        return -1;
+
+    *block_size = size;
+
+    return crc32c(0,buffer,size) == expected ? 1 : 0;
+}
+
+
+
+
+/// Opens the sidecar for verifying reads, NULL if there is nothing to verify against
+
+BFile* BSeries::openVerifiedChecksums(uint32_t key, ENTRY *series, BFile *file){
+
+    settleChecksums(key,series,file);
+
+    if(!block_checksums || !validateChecksums(key,series,file,series->file_size - series->header_size))
+        return NULL;
+
+    BFile *checksums = openChecksumFile(key,false);
+
+    CHECKSUM_HEADER header;
+    if(checksums != NULL && (checksums->read(&header,sizeof(header),0) != sizeof(header) ||
+       header.magic != CHECKSUM_MAGIC || header.block_bytes != (int64_t)write_ahead_size * series->header.datasize)){
+        delete checksums;
+        checksums = NULL;
+    }
+
+    return checksums;
+}
+
+
+
+
+void BSeries::startScrubber(uint64_t bytes_per_second, uint32_t pass_interval){
+
+    stopScrubber();
+
+    scrub_rate = bytes_per_second;
+    scrub_interval = pass_interval;
+    scrubbing = true;
+
+    scrubber = thread(&BSeries::scrubLoop,this);
+}
+
+
+void BSeries::stopScrubber(){
+
+    {
+        lock_guard<mutex> lock(scrub_access);
+        scrubbing = false;
+    }
+    scrub_signal.notify_all();
+
+    if(scrubber.joinable())
+        scrubber.join();
+}
+
+
+
+// Sleeps for up to milliseconds, returns false if the scrubber was stopped
+
+bool BSeries::scrubWait(int64_t milliseconds){
+
+    unique_lock<mutex> lock(scrub_access);
+    if(milliseconds > 0)
+        scrub_signal.wait_for(lock,chrono::milliseconds(milliseconds),[this]{ return !scrubbing; });
+    return scrubbing;
+}
+
+
+
+void BSeries::scrubLoop(){
+
+    while(scrubWait(0)){
+
+        _DEBUG("Scrubbing %s\n",data_directory);
+
+        scrub_bytes = 0;
+        scrub_started = chrono::steady_clock::now();
+
+        vector<uint32_t> keys;
+
+        DIR *directory = opendir(data_directory);
+        if(directory != NULL){
+            struct dirent *item;
+            while((item = readdir(directory)) != NULL){
+                char *end;
+                unsigned long key = strtoul(item->d_name,&end,10);
+                if(end != item->d_name && *end == 0) // Data files only, skip sidecars
+                    keys.push_back(key);
+            }
+            closedir(directory);
+        }
+
+        for(size_t i = 0; i < keys.size(); i++){
+            if(!scrubSeries(keys[i]))
+                return;
+        }
+
+        scrub_passes++;
+
+        if(!scrubWait((int64_t)scrub_interval * 1000))
+            return;
+    }
+}
+
+
+
+/// Verifies every block of one series, the series lock is only held while a single block is read.
+/// Returns false if the scrubber was stopped
+
+bool BSeries::scrubSeries(uint32_t key){
+
+    index_access.lock();
+    ENTRY *series = &series_list[key];
+    index_access.unlock();
+
+    BFile *file = openFile(key,false);
+    BFile *checksums = openChecksumFile(key,false);
+
+    SERIES header;
+    int64_t header_size = 0;
+    CHECKSUM_HEADER checksum_header;
+
+    bool usable = file != NULL && checksums != NULL && parseHeader(file,&header,&header_size) == NO_ERROR &&
+            checksums->read(&checksum_header,sizeof(checksum_header),0) == sizeof(checksum_header) &&
+            checksum_header.magic == CHECKSUM_MAGIC && checksum_header.block_bytes == (int64_t)write_ahead_size * header.datasize;
+
+    bool running = true;
+
+    if(usable){
+        int64_t block_bytes = checksum_header.block_bytes;
+        char *buffer = (char*)malloc(block_bytes);
+
+        for(int64_t block = 0; buffer != NULL; block++){
+
+            series->access.lock();
+
+            settleChecksums(key,series,file);
+
+            int64_t data_bytes = file->size() - header_size;
+            int64_t blocks = (data_bytes + block_bytes - 1) / block_bytes;
+
+            if(block >= blocks || checksums->size() != (int64_t)sizeof(CHECKSUM_HEADER) + blocks * (int64_t)sizeof(uint32_t)){
+                // Done, or the sidecar is not in step with the file yet (rebuilt on the next write)
+                series->access.unlock();
+                break;
+            }
+
+            int64_t size = 0;
+            int result = checkBlock(file,checksums,header_size,header.datasize,data_bytes,block,buffer,&size);
+
+            series->access.unlock();
+
+            scrub_blocks++;
+            if(result == 0){
+                _ERROR("Scrub: block %ld of series %u failed checksum verification\n",(long)block,key);
+                checksum_errors++;
+            }
+
+            // Throttle to scrub_rate
+            scrub_bytes += size;
+            if(scrub_rate){
+                int64_t due = scrub_bytes * 1000 / scrub_rate;
+                int64_t elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - scrub_started).count();
+                if(!scrubWait(due - elapsed)){
+                    running = false;
+                    break;
+                }
+            } else if(!scrubWait(0)){
+                running = false;
+                break;
+            }
+        }
+
+        free(buffer);
+    }
+
+    if(file)
+        delete file;
+    if(checksums)
+        delete checksums;
+
+    return running && scrubWait(0);
+}
@@ -0,0 +1,619 @@
+#include "bseries.h"
+#include "barrow.h"
+#include "debug.h"
+
+#include <set>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+
+
+
+/// Bulk export and import
+///
+/// exportData walks the data directory and writes every series to its own file in the target directory, <key>.csv or
+/// <key>.arrow (Arrow IPC stream, see barrow.h). Series are streamed one block at a time through read(), so memory stays at
+/// one block per worker and cached points are included. Only points that are not null are written, each with its timestamp
+/// in nanoseconds, the header (first timestamp, interval, datasize, datatype) goes into the schema metadata or a leading comment.
+/// A series is written to <key>.<ext>.part and renamed when complete, then its key is appended to export.manifest,
+/// an interrupted export continues with the series missing from the manifest when run again.
+/// For a consistent point in time across series export from a snapshot().
+///
+/// importData loads such files back, consecutive points are gathered into runs and written with writeRangeNs()
+/// instead of point by point. Imports only ever write the points in the files, so running one again is harmless.
+
+
+
+#define EXPORT_MANIFEST "export.manifest"
+
+#define EXPORT_MAX_DATASIZE 256
+#define IMPORT_RUN_BLOCKS 16 // most points per writeRange call, in blocks
+
+
+
+
+static bool isNull(const char *value, uint32_t datatype, uint32_t datasize, char null_fill){
+    if(datatype == DATATYPE_FLOAT && datasize == sizeof(float)){
+        float f;
+        memcpy(&f,value,sizeof(f));
+        return f != f;
+    }
+    if(datatype == DATATYPE_FLOAT && datasize == sizeof(double)){
+        double d;
+        memcpy(&d,value,sizeof(d));
+        return d != d;
+    }
+    for(uint32_t i = 0; i < datasize; i++){
+        if(value[i] != null_fill)
+            return false;
+    }
+    return true;
+}
+
+
+static bool integerType(uint32_t datatype, uint32_t datasize){
+    return (datatype == DATATYPE_UNSIGNED || datatype == DATATYPE_SIGNED) && datasize <= sizeof(uint64_t);
+}
+
+
+static bool floatType(uint32_t datatype, uint32_t datasize){
+    return datatype == DATATYPE_FLOAT && (datasize == sizeof(float) || datasize == sizeof(double));
+}
+
+
+static void formatValue(char *text, size_t size, const char *value, uint32_t datatype, uint32_t datasize){
+    if(floatType(datatype,datasize)){
+        if(datasize == sizeof(float)){
+            float f;
+            memcpy(&f,value,sizeof(f));
+            snprintf(text,size,"%.9g",f);
+        } else {
+            double d;
+            memcpy(&d,value,sizeof(d));
+            snprintf(text,size,"%.17g",d);
+        }
+    } else if(integerType(datatype,datasize)){
+        uint64_t u = 0;
+        memcpy(&u,value,datasize); // little endian
+        if(datatype == DATATYPE_SIGNED && datasize < sizeof(u) && (u >> (8 * datasize - 1)) & 1)
+            u |= ~(uint64_t)0 << (8 * datasize); // sign extend
+        if(datatype == DATATYPE_SIGNED)
+            snprintf(text,size,"%lld",(long long)u);
+        else
+            snprintf(text,size,"%llu",(unsigned long long)u);
+    } else { // Hex, any other datatype
+        for(uint32_t i = 0; i < datasize && 2 * i + 3 <= size; i++)
+            snprintf(text + 2 * i,3,"%02x",(unsigned int)(uint8_t)value[i]);
+    }
+}
+
+
+static bool parseValue(const char *text, char *value, uint32_t datatype, uint32_t datasize){
+    char *end;
+    if(floatType(datatype,datasize)){
+        if(datasize == sizeof(float)){
+            float f = strtof(text,&end);
+            memcpy(value,&f,sizeof(f));
+        } else {
+            double d = strtod(text,&end);
+            memcpy(value,&d,sizeof(d));
+        }
+        return end != text;
+    }
+    if(integerType(datatype,datasize)){
+        uint64_t u;
+        if(datatype == DATATYPE_SIGNED)
+            u = (uint64_t)strtoll(text,&end,10);
+        else
+            u = strtoull(text,&end,10);
+        memcpy(value,&u,datasize);
+        return end != text;
+    }
+    for(uint32_t i = 0; i < datasize; i++){
+        char hex[3] = {text[2 * i],text[2 * i + 1],0};
+        if(!hex[0] || !hex[1])
+            return false;
+        value[i] = (char)strtoul(hex,&end,16);
+        if(*end)
+            return false;
+    }
+    return true;
+}
+
+
+static int arrowValueType(uint32_t datatype, uint32_t datasize){
+    if(datatype == DATATYPE_FLOAT && datasize == sizeof(float))
+        return ARROW_VALUE_FLOAT;
+    if(datatype == DATATYPE_UNSIGNED && datasize == sizeof(uint8_t))
+        return ARROW_VALUE_UINT8;
+    return ARROW_VALUE_BINARY;
+}
+
+
+
+
+/// Writes one series, returns NO_ERROR or the read error
+
+int BSeries::exportSeries(uint32_t key, const char *target_directory, int format, char *buffer, int64_t *exported){
+
+    SERIES header;
+    int64_t total_points = 0;
+    int status = readExtent(key,&header,&total_points);
+    if(status != NO_ERROR)
+        return status;
+
+    const char *extension = format == EXPORT_ARROW ? "arrow" : "csv";
+    char filename[512];
+    char partial[520];
+    snprintf(filename,sizeof(filename),"%s/%u.%s",target_directory,key,extension);
+    snprintf(partial,sizeof(partial),"%s.part",filename);
+
+    uint32_t datasize = header.datasize;
+    if(datasize > EXPORT_MAX_DATASIZE)
+        return INVALID_DATATYPE;
+
+    FILE *csv = NULL;
+    BArrowWriter arrow;
+
+    if(format == EXPORT_ARROW){
+        vector< pair<string,string> > metadata;
+        metadata.push_back(make_pair(string("bseries.key"),to_string(key)));
+        metadata.push_back(make_pair(string("bseries.timestamp_ns"),to_string(header.timestamp)));
+        metadata.push_back(make_pair(string("bseries.interval_ns"),to_string(header.interval)));
+        metadata.push_back(make_pair(string("bseries.datasize"),to_string(datasize)));
+        metadata.push_back(make_pair(string("bseries.datatype"),to_string(header.datatype)));
+        if(!arrow.open(partial,arrowValueType(header.datatype,datasize),datasize,metadata,ARROW_UNIT_NANOSECOND))
+            return EXPORT_FAILED;
+    } else {
+        if((csv = fopen(partial,"w")) == NULL)
+            return EXPORT_FAILED;
+        fprintf(csv,"# bseries key=%u timestamp_ns=%lld interval_ns=%lld datasize=%u datatype=%u\ntimestamp_ns,value\n",key,(long long)header.timestamp,(long long)header.interval,datasize,header.datatype);
+    }
+
+    vector<int64_t> timestamps;
+    string values;
+    bool success = true;
+    *exported = 0;
+
+    for(int64_t point = 0; success && point < total_points; point += write_ahead_size){
+
+        int64_t start_time = header.timestamp + point * header.interval;
+        int64_t n_points = 0, real_points = 0, interval = 0, first_point_timestamp = 0;
+        uint32_t read_datasize = 0;
+        void *result = NULL;
+
+        status = readNs(key,start_time,start_time + (int64_t)write_ahead_size * header.interval,&n_points,&real_points,&interval,&first_point_timestamp,&read_datasize,&result,buffer,write_ahead_size);
+        if(status != NO_ERROR)
+            break;
+
+        timestamps.clear();
+        values.clear();
+
+        for(int64_t i = 0; i < n_points && point + i < total_points; i++){
+            const char *value = buffer + i * datasize;
+            if(isNull(value,header.datatype,datasize,default_null_fill_byte))
+                continue;
+
+            int64_t timestamp = start_time + i * header.interval;
+
+            if(csv != NULL){
+                char text[2 * EXPORT_MAX_DATASIZE + 1];
+                formatValue(text,sizeof(text),value,header.datatype,datasize);
+                success = fprintf(csv,"%lld,%s\n",(long long)timestamp,text) > 0;
+            } else {
+                timestamps.push_back(timestamp);
+                values.append(value,datasize);
+            }
+            (*exported)++;
+        }
+
+        if(csv == NULL)
+            success = arrow.write(timestamps.data(),values.data(),timestamps.size());
+    }
+
+    if(csv != NULL)
+        success = fclose(csv) == 0 && success;
+    else
+        success = arrow.close() && success;
+
+    if(status == NO_ERROR && !success)
+        status = EXPORT_FAILED;
+
+    if(status == NO_ERROR && rename(partial,filename) != 0)
+        status = EXPORT_FAILED;
+
+    if(status != NO_ERROR)
+        unlink(partial);
+
+    return status;
+}
+
+
+
+
+/// Exports series from keys until none are left, buffer holds write_ahead_size points of EXPORT_MAX_DATASIZE
+
+void BSeries::exportWorker(const vector<uint32_t> *keys, const char *target_directory, int format, char *buffer, atomic<size_t> *next, FILE *manifest, mutex *manifest_access, atomic<size_t> *done, atomic<size_t> *failed, atomic<int64_t> *points, function<void(size_t, size_t)> *progress){
+
+    size_t i;
+    while((i = (*next)++) < keys->size()){
+        uint32_t key = (*keys)[i];
+        int64_t exported = 0;
+
+        int status = exportSeries(key,target_directory,format,buffer,&exported);
+
+        lock_guard<mutex> lock(*manifest_access);
+        if(status == NO_ERROR){
+            fprintf(manifest,"%u\n",key);
+            fflush(manifest);
+            *points += exported;
+        } else {
+            _ERROR("Failed to export series %u (%d)\n",key,status);
+            (*failed)++;
+        }
+
+        size_t finished = ++(*done);
+        if(*progress)
+            (*progress)(finished,keys->size());
+    }
+}
+
+
+
+
+static void listKeys(const char *directory, vector<uint32_t> *keys){
+    DIR *d = opendir(directory);
+    if(d == NULL)
+        return;
+    struct dirent *item;
+    while((item = readdir(d)) != NULL){
+        char *end;
+        unsigned long key = strtoul(item->d_name,&end,10);
+        if(end != item->d_name && *end == 0) // Data files only, skip sidecars
+            keys->push_back(key);
+    }
+    closedir(d);
+}
+
+
+
+
+/// Exports every series in data_directory (and every series with cached points) to target_directory as EXPORT_CSV or EXPORT_ARROW.
+/// Series listed in target_directory/export.manifest are skipped, so an interrupted export resumes where it stopped.
+/// Returns NO_ERROR or EXPORT_FAILED if any series could not be exported
+
+int BSeries::exportData(const char *target_directory, int format, unsigned int threads, function<void(size_t exported, size_t total)> progress){
+
+    if(shuttingDown)
+        return EXPORT_FAILED;
+
+    if(mkdir(target_directory,0755) != 0 && errno != EEXIST){
+        _ERROR("Failed to create export directory %s\n",target_directory);
+        return EXPORT_FAILED;
+    }
+
+    char manifest_name[512];
+    snprintf(manifest_name,sizeof(manifest_name),"%s/%s",target_directory,EXPORT_MANIFEST);
+
+    set<uint32_t> completed;
+    FILE *manifest = fopen(manifest_name,"r");
+    if(manifest != NULL){
+        unsigned int key;
+        while(fscanf(manifest,"%u",&key) == 1)
+            completed.insert(key);
+        fclose(manifest);
+    }
+
+    set<uint32_t> all;
+    vector<uint32_t> listed;
+    listKeys(data_directory,&listed);
+    all.insert(listed.begin(),listed.end());
+
+    index_access.lock();
+    for(auto it = series_list.begin(); it != series_list.end(); it++){
+        if(it->second.header.checksum == getChecksum(&it->second.header))
+            all.insert(it->first);
+    }
+    index_access.unlock();
+
+    vector<uint32_t> keys;
+    for(auto it = all.begin(); it != all.end(); it++){
+        if(!completed.count(*it))
+            keys.push_back(*it);
+    }
+
+    cout << "Exporting " << keys.size() << " series to " << target_directory << " (" << completed.size() << " already done)" << endl;
+
+    manifest = fopen(manifest_name,"a");
+    if(manifest == NULL){
+        _ERROR("Failed to open export manifest %s\n",manifest_name);
+        return EXPORT_FAILED;
+    }
+
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+    mutex manifest_access;
+    atomic<size_t> next(0), done(0), failed(0);
+    atomic<int64_t> points(0);
+
+    if(!threads)
+        threads = thread::hardware_concurrency();
+    if(threads > keys.size())
+        threads = keys.size();
+    if(!threads)
+        threads = 1;
+
+    // All buffers up front, a worker without one could not export the keys it claims
+    vector<char*> buffers;
+    for(unsigned int i = 0; i < threads; i++){
+        char *buffer = (char*)malloc((int64_t)write_ahead_size * EXPORT_MAX_DATASIZE);
+        if(buffer == NULL){
+            _ERROR("Failed to allocate export buffers\n");
+            for(size_t j = 0; j < buffers.size(); j++)
+                free(buffers[j]);
+            fclose(manifest);
+            return EXPORT_FAILED;
+        }
+        buffers.push_back(buffer);
+    }
+
+    vector<thread> workers;
+    for(unsigned int i = 1; i < threads; i++)
+        workers.push_back(thread(&BSeries::exportWorker,this,&keys,target_directory,format,buffers[i],&next,manifest,&manifest_access,&done,&failed,&points,&progress));
+
+    exportWorker(&keys,target_directory,format,buffers[0],&next,manifest,&manifest_access,&done,&failed,&points,&progress);
+
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    for(size_t i = 0; i < buffers.size(); i++)
+        free(buffers[i]);
+
+    fclose(manifest);
+
+    int64_t elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+    cout << "\t Done Exporting, " << (done - failed) << " series, " << points << " points in " << elapsed << " ms, " << failed << " failed" << endl;
+
+    return failed ? EXPORT_FAILED : NO_ERROR;
+}
+
+
+
+
+/// Writes the run of consecutive points gathered so far
+
+static int flushRun(BSeries *db, uint32_t key, int64_t *run_start, string *run, uint32_t datasize, int64_t interval, uint32_t datatype){
+    int status = NO_ERROR;
+    if(!run->empty())
+        status = db->writeRangeNs(key,*run_start,run->data(),run->size() / datasize,datasize,interval,datatype);
+    run->clear();
+    return status;
+}
+
+
+
+
+/// Imports one file written by exportData, returns NO_ERROR, EXPORT_FAILED if the file can not be read or the write error,
+/// INVALID_DATATYPE when the series already exists with a different interval or datasize.
+/// Files of earlier versions, with times in seconds, are imported as well
+
+int BSeries::importFile(const char *filename, int64_t *imported){
+
+    *imported = 0;
+
+    uint32_t key = 0;
+    int64_t interval = 0; // nanoseconds
+    int64_t scale = NS_PER_SECOND; // nanoseconds per unit of the timestamps in the file
+    uint32_t datasize = 0;
+    uint32_t datatype = DATATYPE_DEFAULT;
+    bool found_key = false;
+
+    bool arrow_format = strlen(filename) > 6 && strcmp(filename + strlen(filename) - 6,".arrow") == 0;
+
+    BArrowReader arrow;
+    FILE *csv = NULL;
+    char line[2 * EXPORT_MAX_DATASIZE + 64];
+
+    if(arrow_format){
+        if(!arrow.open(filename))
+            return EXPORT_FAILED;
+        datasize = arrow.datasize;
+        const int64_t scales[] = {NS_PER_SECOND,1000000,1000,1};
+        scale = scales[arrow.timestamp_unit];
+        datatype = arrow.value_type == ARROW_VALUE_FLOAT ? DATATYPE_FLOAT : arrow.value_type == ARROW_VALUE_UINT8 ? DATATYPE_UNSIGNED : DATATYPE_BINARY;
+        for(size_t i = 0; i < arrow.metadata.size(); i++){
+            const string &name = arrow.metadata[i].first;
+            const char *text = arrow.metadata[i].second.c_str();
+            if(name == "bseries.key"){
+                key = strtoul(text,NULL,10);
+                found_key = true;
+            } else if(name == "bseries.interval_ns"){
+                interval = strtoll(text,NULL,10);
+            } else if(name == "bseries.interval"){
+                interval = strtoll(text,NULL,10) * NS_PER_SECOND;
+            } else if(name == "bseries.datatype"){
+                datatype = strtoul(text,NULL,10);
+            }
+        }
+    } else {
+        if((csv = fopen(filename,"r")) == NULL)
+            return EXPORT_FAILED;
+        unsigned int k = 0, d = 0, type = 0;
+        long long t, i;
+        if(fgets(line,sizeof(line),csv) != NULL){
+            if(sscanf(line,"# bseries key=%u timestamp_ns=%lld interval_ns=%lld datasize=%u datatype=%u",&k,&t,&i,&d,&type) == 5){
+                interval = i;
+                datatype = type;
+                scale = 1;
+                found_key = true;
+            } else if(sscanf(line,"# bseries key=%u timestamp=%lld interval=%lld datasize=%u",&k,&t,&i,&d) == 4){
+                interval = i * NS_PER_SECOND;
+                found_key = true;
+            }
+            key = k;
+            datasize = d;
+        }
+        if(fgets(line,sizeof(line),csv) == NULL) // Column names
+            found_key = false;
+    }
+
+    if(datatype == DATATYPE_DEFAULT)
+        datatype = datasize == sizeof(float) ? DATATYPE_FLOAT : datasize == sizeof(uint8_t) ? DATATYPE_UNSIGNED : DATATYPE_BINARY;
+
+    if(!found_key || interval <= 0 || !datasize || datasize > EXPORT_MAX_DATASIZE){
+        _ERROR("Not a bseries export: %s\n",filename);
+        if(csv)
+            fclose(csv);
+        return EXPORT_FAILED;
+    }
+
+    int64_t run_start = 0;
+    int64_t run_last = 0;
+    string run;
+    int64_t max_run = (int64_t)write_ahead_size * IMPORT_RUN_BLOCKS * datasize;
+    int status = NO_ERROR;
+
+    vector<int64_t> timestamps;
+    string values;
+    char value[EXPORT_MAX_DATASIZE];
+
+    while(status == NO_ERROR){
+
+        // Next batch of (timestamp, value)
+        if(arrow_format){
+            int64_t rows = arrow.next(&timestamps,&values);
+            if(rows < 0)
+                status = EXPORT_FAILED;
+            if(rows <= 0)
+                break;
+        } else {
+            timestamps.clear();
+            values.clear();
+            while(timestamps.size() < (size_t)write_ahead_size && fgets(line,sizeof(line),csv) != NULL){
+                char *comma = strchr(line,',');
+                if(comma == NULL)
+                    continue;
+                *comma = 0;
+                char *newline = strchr(comma + 1,'\n');
+                if(newline)
+                    *newline = 0;
+                if(!parseValue(comma + 1,value,datatype,datasize)){
+                    status = EXPORT_FAILED;
+                    break;
+                }
+                timestamps.push_back(strtoll(line,NULL,10));
+                values.append(value,datasize);
+            }
+            if(timestamps.empty())
+                break;
+        }
+
+        for(size_t i = 0; status == NO_ERROR && i < timestamps.size(); i++){
+            int64_t timestamp = timestamps[i] * scale;
+            if(timestamp <= 0)
+                continue;
+
+            if(run.empty() || timestamp != run_last + interval || (int64_t)run.size() >= max_run){
+                status = flushRun(this,key,&run_start,&run,datasize,interval,datatype);
+                run_start = timestamp;
+            }
+            run.append(values.data() + i * datasize,datasize);
+            run_last = timestamp;
+            (*imported)++;
+        }
+    }
+
+    if(status == NO_ERROR)
+        status = flushRun(this,key,&run_start,&run,datasize,interval,datatype);
+
+    if(csv)
+        fclose(csv);
+
+    return status;
+}
+
+
+
+
+void BSeries::importWorker(const vector<string> *files, atomic<size_t> *next, atomic<size_t> *done, atomic<size_t> *failed, atomic<int64_t> *points, mutex *progress_access, function<void(size_t, size_t)> *progress){
+
+    size_t i;
+    while((i = (*next)++) < files->size()){
+        int64_t imported = 0;
+        int status = importFile((*files)[i].c_str(),&imported);
+
+        *points += imported;
+        if(status != NO_ERROR){
+            _ERROR("Failed to import %s (%d)\n",(*files)[i].c_str(),status);
+            (*failed)++;
+        }
+
+        size_t finished = ++(*done);
+        if(*progress){
+            lock_guard<mutex> lock(*progress_access);
+            (*progress)(finished,files->size());
+        }
+    }
+}
+
+
+
+
+/// Imports every <key>.csv and <key>.arrow file in source_directory into this database.
+/// Returns NO_ERROR or EXPORT_FAILED if any file could not be imported
+
+int BSeries::importData(const char *source_directory, unsigned int threads, function<void(size_t imported, size_t total)> progress){
+
+    if(shuttingDown)
+        return EXPORT_FAILED;
+
+    vector<string> files;
+
+    DIR *directory = opendir(source_directory);
+    if(directory == NULL){
+        _ERROR("Failed to open import directory %s\n",source_directory);
+        return EXPORT_FAILED;
+    }
+    struct dirent *item;
+    while((item = readdir(directory)) != NULL){
+        char *end;
+        strtoul(item->d_name,&end,10);
+        if(end != item->d_name && (strcmp(end,".csv") == 0 || strcmp(end,".arrow") == 0))
+            files.push_back(string(source_directory) + "/" + item->d_name);
+    }
+    closedir(directory);
+
+    cout << "Importing " << files.size() << " files from " << source_directory << endl;
+
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+    atomic<size_t> next(0), done(0), failed(0);
+    atomic<int64_t> points(0);
+    mutex progress_access;
+
+    if(!threads)
+        threads = thread::hardware_concurrency();
+    if(!threads)
+        threads = 1;
+    if(threads > files.size())
+        threads = files.size();
+
+    vector<thread> workers;
+    for(unsigned int i = 1; i < threads; i++)
+        workers.push_back(thread(&BSeries::importWorker,this,&files,&next,&done,&failed,&points,&progress_access,&progress));
+
+    importWorker(&files,&next,&done,&failed,&points,&progress_access,&progress);
+
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    int64_t elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+    cout << "\t Done Importing, " << (done - failed) << " files, " << points << " points in " << elapsed << " ms, " << failed << " failed" << endl;
+
+    return failed ? EXPORT_FAILED : NO_ERROR;
+}
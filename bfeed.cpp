@@ -0,0 +1,362 @@
+#include "bfeed.h"
+
+#include <string.h>
+
+
+
+
+BFeed::BFeed()
+{
+    capacity = 1 << 16;
+    mask = capacity - 1;
+    ring = NULL;
+    next = 0;
+    parked = 0;
+    signalled = false;
+    next_id = 0;
+    subscribers = 0;
+    running = false;
+    batch_size = 1024;
+}
+
+
+BFeed::~BFeed()
+{
+    stop();
+    delete[] ring.load();
+}
+
+
+
+
+bool BFeed::setCapacity(size_t events){
+
+    std::lock_guard<std::mutex> lock(access);
+
+    if(ring.load() != NULL)
+        return false;
+
+    size_t rounded = 1;
+    while(rounded < events)
+        rounded <<= 1;
+
+    capacity = rounded;
+    mask = capacity - 1;
+    return true;
+}
+
+
+
+
+/// Fills the slot of a reserved sequence, waits for the writer of the previous lap if it has not finished with the slot yet
+
+void BFeed::write(SLOT *slots, uint64_t sequence, uint32_t key, int64_t timestamp, const void *value, uint32_t datasize){
+
+    SLOT *slot = &slots[sequence & mask];
+
+    if(sequence >= capacity){
+        uint64_t previous = 2 * (sequence - capacity + 1);
+        while(slot->stamp.load(std::memory_order_acquire) < previous)
+            std::this_thread::yield();
+    }
+
+    uint64_t bits = 0;
+    memcpy(&bits,value,datasize < sizeof(bits) ? datasize : sizeof(bits));
+
+    slot->stamp.store(2 * sequence + 1,std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->key.store(((uint64_t)key << 32) | datasize,std::memory_order_relaxed);
+    slot->timestamp.store(timestamp,std::memory_order_relaxed);
+    slot->value.store(bits,std::memory_order_relaxed);
+    slot->stamp.store(2 * (sequence + 1),std::memory_order_release);
+}
+
+
+/// Wakes parked subscribers, only the first writer after they parked takes the lock
+
+void BFeed::wake(){
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if(parked.load(std::memory_order_relaxed) > 0 && !signalled.exchange(true)){
+        std::lock_guard<std::mutex> lock(access);
+        signal.notify_all();
+    }
+}
+
+
+
+
+/// Called by writers holding their series lock, only when active()
+
+void BFeed::publish(uint32_t key, int64_t timestamp, const void *value, uint32_t datasize){
+
+    SLOT *slots = ring.load(std::memory_order_acquire);
+    if(slots == NULL)
+        return;
+
+    write(slots,next.fetch_add(1,std::memory_order_relaxed),key,timestamp,value,datasize);
+    wake();
+}
+
+
+/// n_values consecutive points of one key, interval apart, with a single reservation and wake up
+
+void BFeed::publish(uint32_t key, int64_t timestamp, int64_t interval, const void *values, size_t n_values, uint32_t datasize){
+
+    SLOT *slots = ring.load(std::memory_order_acquire);
+    if(slots == NULL || n_values == 0)
+        return;
+
+    const char *data = (const char*)values;
+    uint64_t sequence = next.fetch_add(n_values,std::memory_order_relaxed);
+    for(size_t i = 0; i < n_values; i++)
+        write(slots,sequence + i,key,timestamp + (int64_t)i * interval,data + i * datasize,datasize);
+
+    wake();
+}
+
+
+
+
+int BFeed::subscribe(const uint32_t *keys, size_t n_keys, FEED_CALLBACK callback, uint64_t from_sequence){
+
+    std::shared_ptr<SUBSCRIPTION> subscription(new SUBSCRIPTION());
+    if(keys != NULL)
+        subscription->keys.insert(keys,keys + n_keys);
+    subscription->callback = callback;
+    subscription->missed = 0;
+
+    std::lock_guard<std::mutex> lock(access);
+
+    if(ring.load() == NULL)
+        ring.store(new SLOT[capacity](),std::memory_order_release);
+
+    // Anything older than the ring is reported as missed on the first batch
+    uint64_t head = next.load();
+    subscription->cursor = from_sequence > head ? head : from_sequence;
+
+    int id = next_id++;
+    subscriptions[id] = subscription;
+    subscribers++;
+
+    if(callback && !running){
+        if(dispatcher.joinable())
+            dispatcher.join();
+        running = true;
+        dispatcher = std::thread(&BFeed::dispatchLoop,this);
+    }
+
+    return id;
+}
+
+
+void BFeed::unsubscribe(int id){
+
+    std::lock_guard<std::mutex> lock(access);
+
+    if(subscriptions.erase(id))
+        subscribers--;
+}
+
+
+
+
+/// True when the event at cursor is written or the ring has already wrapped past it
+
+bool BFeed::ready(uint64_t cursor){
+
+    SLOT *slots = ring.load(std::memory_order_acquire);
+    return slots != NULL && slots[cursor & mask].stamp.load(std::memory_order_acquire) >= 2 * (cursor + 1);
+}
+
+
+
+
+/// Copies up to max_events matching events from the subscribers cursor into out and advances the cursor, access must be held.
+/// Stops at the first sequence that is reserved but not written yet, slots overwritten by a later lap are counted as missed
+
+size_t BFeed::collect(SUBSCRIPTION *subscription, std::vector<FEED_EVENT> *out, size_t max_events, uint64_t *missed){
+
+    SLOT *slots = ring.load(std::memory_order_acquire);
+    uint64_t head = next.load(std::memory_order_acquire);
+
+    uint64_t oldest = head > capacity ? head - capacity : 0;
+    if(subscription->cursor < oldest){
+        subscription->missed += oldest - subscription->cursor;
+        subscription->cursor = oldest;
+    }
+
+    size_t found = 0;
+    while(subscription->cursor < head && found < max_events){
+        SLOT *slot = &slots[subscription->cursor & mask];
+        uint64_t expected = 2 * (subscription->cursor + 1);
+
+        uint64_t stamp = slot->stamp.load(std::memory_order_acquire);
+        if(stamp < expected)
+            break;
+
+        FEED_EVENT event;
+        event.sequence = subscription->cursor;
+        uint64_t key = slot->key.load(std::memory_order_relaxed);
+        event.timestamp = slot->timestamp.load(std::memory_order_relaxed);
+        uint64_t bits = slot->value.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        subscription->cursor++;
+
+        if(stamp != expected || slot->stamp.load(std::memory_order_relaxed) != expected){
+            subscription->missed++;
+            continue;
+        }
+
+        event.key = key >> 32;
+        event.datasize = (uint32_t)key;
+        memcpy(event.value.bytes,&bits,sizeof(event.value.bytes));
+
+        if(!subscription->keys.empty() && !subscription->keys.count(event.key))
+            continue;
+
+        out->push_back(event);
+        found++;
+    }
+
+    if(missed)
+        *missed = subscription->missed;
+    subscription->missed = 0;
+
+    return found;
+}
+
+
+
+
+/// Events for a polled subscription, waits up to wait_milliseconds when there is nothing new
+
+size_t BFeed::poll(int id, std::vector<FEED_EVENT> *out, size_t max_events, int64_t wait_milliseconds, uint64_t *missed){
+
+    std::unique_lock<std::mutex> lock(access);
+
+    auto found = subscriptions.find(id);
+    if(found == subscriptions.end())
+        return 0;
+
+    std::shared_ptr<SUBSCRIPTION> subscription = found->second;
+
+    if(wait_milliseconds > 0 && !ready(subscription->cursor)){
+        parked++;
+        signal.wait_for(lock,std::chrono::milliseconds(wait_milliseconds),[this,&subscription]{
+            signalled.store(false);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return ready(subscription->cursor) || !subscribers;
+        });
+        parked--;
+    }
+
+    return collect(subscription.get(),out,max_events,missed);
+}
+
+
+
+
+uint64_t BFeed::position(int id){
+
+    std::lock_guard<std::mutex> lock(access);
+
+    auto found = subscriptions.find(id);
+    return found == subscriptions.end() ? 0 : found->second->cursor;
+}
+
+
+uint64_t BFeed::lag(int id){
+
+    std::lock_guard<std::mutex> lock(access);
+
+    auto found = subscriptions.find(id);
+    if(found == subscriptions.end())
+        return 0;
+    return next.load() - found->second->cursor + found->second->missed;
+}
+
+
+uint64_t BFeed::sequence(){
+
+    return next.load();
+}
+
+
+
+
+/// Delivers batches to callback subscriptions, callbacks run without the feed lock so they may subscribe,
+/// unsubscribe or take their time, writers are never blocked by them
+
+void BFeed::dispatchLoop(){
+
+    std::vector<FEED_EVENT> batch;
+    batch.reserve(batch_size);
+
+    std::unique_lock<std::mutex> lock(access);
+
+    while(running){
+
+        bool delivered = false;
+
+        for(auto it = subscriptions.begin(); it != subscriptions.end(); ){
+            std::shared_ptr<SUBSCRIPTION> subscription = it->second;
+            int id = it->first;
+
+            if(!subscription->callback || !ready(subscription->cursor)){
+                it++;
+                continue;
+            }
+
+            batch.clear();
+            uint64_t missed = 0;
+            collect(subscription.get(),&batch,batch_size,&missed);
+
+            if(!batch.empty() || missed){
+                lock.unlock();
+                subscription->callback(batch.data(),batch.size(),missed);
+                lock.lock();
+                delivered = true;
+            }
+
+            it = subscriptions.upper_bound(id); // The map may have changed while unlocked
+        }
+
+        if(!delivered){
+            parked++;
+            signal.wait(lock,[this]{
+                signalled.store(false);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(!running)
+                    return true;
+                for(auto it = subscriptions.begin(); it != subscriptions.end(); it++){
+                    if(it->second->callback && ready(it->second->cursor))
+                        return true;
+                }
+                return false;
+            });
+            parked--;
+        }
+    }
+}
+
+
+
+
+/// Stops the dispatcher and drops every subscription, pollers waiting in poll() return
+
+void BFeed::stop(){
+
+    {
+        std::lock_guard<std::mutex> lock(access);
+        running = false;
+        subscriptions.clear();
+        subscribers = 0;
+    }
+    signal.notify_all();
+
+    if(dispatcher.joinable())
+        dispatcher.join();
+}
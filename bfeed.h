@@ -0,0 +1,127 @@
+#ifndef BFEED_H
+#define BFEED_H
+
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <set>
+#include <map>
+
+
+
+#define FEED_FROM_NOW UINT64_MAX // subscribe from the next write
+
+
+
+typedef struct
+{
+     uint64_t sequence;
+     uint32_t key;
+     uint32_t datasize;
+     int64_t timestamp; // nanoseconds
+     union {
+          char bytes[8]; // first 8 bytes of larger values
+          float f;
+          uint8_t u8;
+     } value;
+} FEED_EVENT;
+
+
+/// Called on the dispatcher thread with a batch of events in sequence order,
+/// missed is the number of events dropped since the last batch because the subscriber fell behind the ring
+/// (every dropped event is counted, also those of keys the subscriber does not follow)
+
+typedef std::function<void(const FEED_EVENT *events, size_t n_events, uint64_t missed)> FEED_CALLBACK;
+
+
+
+
+/// Change feed
+///
+/// Every successful write is appended as (sequence, key, timestamp, value) to a bounded in memory ring, subscribers
+/// read the ring from their own cursor so a slow subscriber never holds up writers or other subscribers, it falls behind
+/// and is told how many events it missed when the ring wraps past it. Writers take no lock, they reserve sequences
+/// with one atomic add and stamp each slot with its sequence when it is complete, readers copy a slot and check the
+/// stamp did not change. Waiting subscribers are only woken when one is parked, once per park. Subscribers either get batches on a callback
+/// (one dispatcher thread per feed) or poll. Sequences are per feed (per BSeries, so per shard in BShardedSeries),
+/// a subscriber can resume from the last sequence it processed as long as that is still in the ring.
+///
+/// Nothing is allocated and writes only load one atomic until the first subscriber arrives.
+
+class BFeed
+{
+public:
+    BFeed();
+    ~BFeed();
+
+    bool setCapacity(size_t events); // before the first subscribe, rounded up to a power of two, false once the ring exists
+
+    bool active() { return subscribers.load(std::memory_order_relaxed) != 0; }
+    void publish(uint32_t key, int64_t timestamp, const void *value, uint32_t datasize);
+    void publish(uint32_t key, int64_t timestamp, int64_t interval, const void *values, size_t n_values, uint32_t datasize);
+
+    // keys = NULL for every key, callback empty to poll, returns the subscription id or -1
+    int subscribe(const uint32_t *keys, size_t n_keys, FEED_CALLBACK callback = nullptr, uint64_t from_sequence = FEED_FROM_NOW);
+    void unsubscribe(int id);
+
+    size_t poll(int id, std::vector<FEED_EVENT> *out, size_t max_events, int64_t wait_milliseconds = 0, uint64_t *missed = NULL);
+
+    uint64_t position(int id); // next sequence the subscriber will see
+    uint64_t lag(int id); // events written but not yet delivered to the subscriber, including missed ones
+    uint64_t sequence(); // sequence of the next write
+
+    void stop();
+
+    size_t batch_size; // most events per callback
+
+private:
+    typedef struct
+    {
+         std::atomic<uint64_t> stamp; // 2 * (sequence + 1) once written, odd while a writer is filling it
+         std::atomic<uint64_t> key; // key << 32 | datasize
+         std::atomic<int64_t> timestamp;
+         std::atomic<uint64_t> value;
+    } SLOT;
+
+    typedef struct
+    {
+         std::set<uint32_t> keys; // empty = every key
+         FEED_CALLBACK callback;
+         uint64_t cursor;
+         uint64_t missed;
+    } SUBSCRIPTION;
+
+    void write(SLOT *slots, uint64_t sequence, uint32_t key, int64_t timestamp, const void *value, uint32_t datasize);
+    void wake();
+    bool ready(uint64_t cursor);
+    size_t collect(SUBSCRIPTION *subscription, std::vector<FEED_EVENT> *out, size_t max_events, uint64_t *missed);
+    void dispatchLoop();
+
+    std::mutex access; // subscriptions and their cursors, writers only take it to wake a parked subscriber
+    std::condition_variable signal;
+    std::atomic<int> parked; // subscribers waiting on signal
+    std::atomic<bool> signalled; // a writer already woke them since they last checked
+
+    std::atomic<SLOT*> ring; // allocated by the first subscribe
+    size_t capacity;
+    size_t mask;
+    std::atomic<uint64_t> next; // next sequence to reserve
+
+    std::map<int, std::shared_ptr<SUBSCRIPTION> > subscriptions;
+    int next_id;
+    std::atomic<int> subscribers;
+
+    std::thread dispatcher; // started by the first callback subscription
+    bool running;
+};
+
+
+#endif // BFEED_H
@@ -0,0 +1,60 @@
+#ifndef BINTERVAL_H
+#define BINTERVAL_H
+
+
+
+#include <stdint.h>
+
+
+
+/// Division by a series interval without a divide instruction on the write and read paths
+///
+/// set() is called once when the header is loaded. Power of two intervals divide with a shift, any other interval
+/// multiplies by a precomputed reciprocal (high 64 bits of a 64 x 64 bit product) and corrects the quotient by at
+/// most two, so the result is exact for every 64 bit numerator. Quotients truncate toward zero like the / operator.
+
+class BInterval
+{
+public:
+    BInterval() : interval(1), shift(0), reciprocal(0) {}
+
+    void set(int64_t interval){
+        this->interval = interval > 0 ? interval : 1;
+        shift = -1;
+        reciprocal = 0;
+
+        if((this->interval & (this->interval - 1)) == 0){
+            shift = 0;
+            while(((int64_t)1 << shift) != this->interval)
+                shift++;
+        } else {
+            reciprocal = UINT64_MAX / (uint64_t)this->interval;
+        }
+    }
+
+    int64_t divide(int64_t ticks) const {
+        return ticks < 0 ? -(int64_t)divideUnsigned(-(uint64_t)ticks) : (int64_t)divideUnsigned(ticks);
+    }
+
+    int64_t interval;
+
+private:
+    uint64_t divideUnsigned(uint64_t n) const {
+        if(shift >= 0)
+            return n >> shift;
+#ifdef __SIZEOF_INT128__
+        uint64_t q = (uint64_t)(((unsigned __int128)n * reciprocal) >> 64);
+        while(n - q * (uint64_t)interval >= (uint64_t)interval) // at most twice
+            q++;
+        return q;
+#else
+        return n / (uint64_t)interval;
+#endif
+    }
+
+    int shift; // -1 when interval is not a power of two
+    uint64_t reciprocal; // UINT64_MAX / interval
+};
+
+
+#endif // BINTERVAL_H
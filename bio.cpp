@@ -0,0 +1,250 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // O_DIRECT
+#endif
+
+#include "bio.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+
+
+static int openDescriptor(const char *filename, bool writeMode, int extra_flags){
+
+    int flags = (writeMode ? (O_RDWR | O_CREAT) : O_RDONLY) | extra_flags;
+    int fd;
+
+    do {
+        fd = ::open(filename,flags,0644);
+    } while(fd < 0 && errno == EINTR);
+
+    return fd;
+}
+
+
+
+// Loops over short transfers, returns bytes transferred or -1
+
+static int64_t fullRead(int fd, void *buffer, int64_t size, int64_t offset){
+
+    int64_t done = 0;
+    while(done < size){
+        ssize_t n = ::pread(fd,(char*)buffer + done,size - done,offset + done);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(n == 0) // End of file
+            break;
+        done += n;
+    }
+    return done;
+}
+
+
+static int64_t fullWrite(int fd, const void *buffer, int64_t size, int64_t offset){
+
+    int64_t done = 0;
+    while(done < size){
+        ssize_t n = ::pwrite(fd,(const char*)buffer + done,size - done,offset + done);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+
+static int64_t descriptorSize(int fd){
+    struct stat st;
+    if(fstat(fd,&st) != 0)
+        return -1;
+    return st.st_size;
+}
+
+
+
+
+class BPosixFile : public BFile
+{
+public:
+    BPosixFile(int fd) : fd(fd) {}
+    ~BPosixFile() { ::close(fd); }
+
+    int64_t read(void *buffer, int64_t size, int64_t offset) { return fullRead(fd,buffer,size,offset); }
+    int64_t write(const void *buffer, int64_t size, int64_t offset) { return fullWrite(fd,buffer,size,offset); }
+    int64_t size() { return descriptorSize(fd); }
+
+    int fd;
+};
+
+
+
+
+BFile* BPosixIO::open(const char *filename, bool writeMode){
+
+    int fd = openDescriptor(filename,writeMode,0);
+    if(fd < 0)
+        return NULL;
+
+    return new BPosixFile(fd);
+}
+
+
+void* BPosixIO::allocBuffer(size_t size){
+    return malloc(size);
+}
+
+
+void BPosixIO::freeBuffer(void *buffer){
+    free(buffer);
+}
+
+
+
+
+class BDirectFile : public BFile
+{
+public:
+    BDirectFile(int fd, size_t alignment) : fd(fd), alignment(alignment) {}
+    ~BDirectFile() { ::close(fd); }
+
+    bool aligned(const void *buffer, int64_t size, int64_t offset){
+        return ((uintptr_t)buffer % alignment) == 0 && (size % alignment) == 0 && (offset % alignment) == 0;
+    }
+
+    int64_t read(void *buffer, int64_t size, int64_t offset);
+    int64_t write(const void *buffer, int64_t size, int64_t offset);
+    int64_t size() { return descriptorSize(fd); }
+
+    int fd;
+    size_t alignment;
+};
+
+
+
+int64_t BDirectFile::read(void *buffer, int64_t size, int64_t offset){
+
+    if(aligned(buffer,size,offset))
+        return fullRead(fd,buffer,size,offset);
+
+    int64_t start = offset - (offset % alignment);
+    int64_t end = ((offset + size + alignment - 1) / alignment) * alignment;
+
+    void *bounce = NULL;
+    if(posix_memalign(&bounce,alignment,end - start) != 0)
+        return -1;
+
+    int64_t n = fullRead(fd,bounce,end - start,start);
+
+    int64_t copied = -1;
+    if(n >= 0){
+        copied = n - (offset - start); // Bytes past our offset
+        if(copied > size)
+            copied = size;
+        if(copied < 0)
+            copied = 0;
+        memcpy(buffer,(char*)bounce + (offset - start),copied);
+    }
+
+    free(bounce);
+    return copied;
+}
+
+
+
+int64_t BDirectFile::write(const void *buffer, int64_t size, int64_t offset){
+
+    int64_t logical_size = descriptorSize(fd);
+    if(logical_size < 0)
+        return -1;
+
+    int64_t start = offset - (offset % alignment);
+    int64_t end = ((offset + size + alignment - 1) / alignment) * alignment;
+
+    if(aligned(buffer,size,offset))
+        return fullWrite(fd,buffer,size,offset);
+
+    void *bounce = NULL;
+    if(posix_memalign(&bounce,alignment,end - start) != 0)
+        return -1;
+    memset(bounce,0,end - start);
+
+    // Read-modify-write the partial blocks at either end
+    bool head = start < offset;
+    bool tail = end > offset + size && !(head && end - (int64_t)alignment == start);
+
+    if(head && fullRead(fd,bounce,alignment,start) < 0){
+        free(bounce);
+        return -1;
+    }
+    if(tail && fullRead(fd,(char*)bounce + (end - start) - alignment,alignment,end - alignment) < 0){
+        free(bounce);
+        return -1;
+    }
+
+    memcpy((char*)bounce + (offset - start),buffer,size);
+
+    int64_t n = fullWrite(fd,bounce,end - start,start);
+    free(bounce);
+
+    if(n != end - start)
+        return -1;
+
+    // The padding at the end must not become part of the file
+    if(end > logical_size && ftruncate(fd,(offset + size > logical_size) ? offset + size : logical_size) != 0)
+        return -1;
+
+    return size;
+}
+
+
+
+
+BDirectIO::BDirectIO(size_t alignment)
+{
+    this->alignment = alignment;
+}
+
+
+BFile* BDirectIO::open(const char *filename, bool writeMode){
+
+    int fd = openDescriptor(filename,writeMode,O_DIRECT);
+
+    if(fd < 0 && errno == EINVAL){
+        _WARN("O_DIRECT not supported for %s, using buffered I/O\n",filename);
+        fd = openDescriptor(filename,writeMode,0);
+    }
+
+    if(fd < 0)
+        return NULL;
+
+    return new BDirectFile(fd,alignment);
+}
+
+
+void* BDirectIO::allocBuffer(size_t size){
+
+    void *buffer = NULL;
+    // Round up so whole cache buffers are always a multiple of the alignment
+    size_t rounded = ((size + alignment - 1) / alignment) * alignment;
+    if(posix_memalign(&buffer,alignment,rounded) != 0)
+        return NULL;
+    return buffer;
+}
+
+
+void BDirectIO::freeBuffer(void *buffer){
+    free(buffer);
+}
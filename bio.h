@@ -0,0 +1,89 @@
+#ifndef BIO_H
+#define BIO_H
+
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+
+/// Pluggable I/O backend
+///
+/// All file access goes through BFile using explicit offsets (pread/pwrite style),
+/// there is no seek state so a file can be shared by concurrent readers.
+/// Backends also own the allocation of cache buffers so they can hand out aligned memory.
+
+
+
+class BFile
+{
+public:
+    virtual ~BFile() {}
+
+    // Both return the number of bytes transferred, or -1 on error
+    virtual int64_t read(void *buffer, int64_t size, int64_t offset) = 0;
+    virtual int64_t write(const void *buffer, int64_t size, int64_t offset) = 0;
+
+    virtual int64_t size() = 0;
+};
+
+
+
+class BIOBackend
+{
+public:
+    virtual ~BIOBackend() {}
+
+    // Opens an existing file, if writeMode is set the file is created when missing. Returns NULL on failure, delete to close
+    virtual BFile* open(const char *filename, bool writeMode) = 0;
+
+    virtual void* allocBuffer(size_t size) = 0;
+    virtual void freeBuffer(void *buffer) = 0;
+
+    // File offsets writes should start and end on to avoid a read-modify-write, 0 = any offset
+    virtual size_t writeAlignment() { return 0; }
+};
+
+
+
+
+/// Raw file descriptors with pread/pwrite, data goes through the page cache
+
+class BPosixIO : public BIOBackend
+{
+public:
+    BFile* open(const char *filename, bool writeMode);
+
+    void* allocBuffer(size_t size);
+    void freeBuffer(void *buffer);
+};
+
+
+
+
+/// O_DIRECT, bypasses the page cache so flushes do not evict read pages.
+///
+/// Aligned writes from aligned buffers (the write ahead caches) go straight to disk,
+/// anything else (direct point writes, partial flushes) is bounced through an aligned buffer
+/// with a read-modify-write of the partial blocks at either end. Series created through a backend with a
+/// writeAlignment() start their data on SERIES_ALIGNED_DATA_OFFSET so full cache flushes land on aligned offsets.
+/// Falls back to buffered I/O if the filesystem dose not support O_DIRECT
+
+class BDirectIO : public BIOBackend
+{
+public:
+    BDirectIO(size_t alignment = 4096);
+
+    BFile* open(const char *filename, bool writeMode);
+
+    void* allocBuffer(size_t size);
+    void freeBuffer(void *buffer);
+
+    size_t writeAlignment() { return alignment; }
+
+    size_t alignment;
+};
+
+
+#endif // BIO_H
@@ -0,0 +1,210 @@
+#include "blatest.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+
+
+BLatest::BLatest()
+{
+    slots = NULL;
+    capacity = 1 << 17;
+    mask = capacity - 1;
+    count = 0;
+    dropped = 0;
+}
+
+
+BLatest::~BLatest()
+{
+    free(slots.load());
+}
+
+
+
+
+bool BLatest::setCapacity(size_t size){
+
+    std::lock_guard<std::mutex> lock(sizing);
+
+    // Lock free readers may be probing the table, it is never resized once allocated
+    if(slots.load(std::memory_order_acquire) != NULL)
+        return false;
+
+    size_t rounded = 1;
+    while(rounded < size)
+        rounded <<= 1;
+
+    capacity = rounded;
+    mask = capacity - 1;
+    return true;
+}
+
+
+
+// The table is only allocated by the first update, a BSeries that never writes costs nothing
+
+bool BLatest::allocate(){
+
+    std::call_once(allocated,[this](){
+        std::lock_guard<std::mutex> lock(sizing);
+        void *memory = NULL;
+        if(posix_memalign(&memory,64,capacity * sizeof(SLOT)) == 0){
+            memset(memory,0,capacity * sizeof(SLOT)); // all zero is an empty slot
+            slots.store((SLOT*)memory,std::memory_order_release);
+        }
+    });
+
+    return slots.load(std::memory_order_acquire) != NULL;
+}
+
+
+
+
+BLatest::SLOT* BLatest::find(uint32_t key, bool insert){
+
+    SLOT *table = slots.load(std::memory_order_acquire);
+    if(table == NULL)
+        return NULL;
+
+    uint64_t wanted = (uint64_t)key + 1;
+    size_t position = (key * 2654435761u) & mask;
+
+    size_t probes = capacity < LATEST_MAX_PROBE ? capacity : LATEST_MAX_PROBE;
+
+    for(size_t probe = 0; probe < probes; probe++){
+        SLOT *slot = &table[(position + probe) & mask];
+
+        uint64_t current = slot->key.load(std::memory_order_acquire);
+        if(current == wanted)
+            return slot;
+
+        if(current == 0){
+            if(!insert)
+                return NULL;
+
+            if(slot->key.compare_exchange_strong(current,wanted,std::memory_order_acq_rel)){
+                count++;
+                return slot;
+            }
+            if(current == wanted) // Another writer claimed it for the same key
+                return slot;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+
+/// Keeps the value if timestamp is not older than what we have, late backfill never replaces a newer value
+
+bool BLatest::update(uint32_t key, int64_t timestamp, const void *value, uint32_t datasize){
+
+    if(datasize > sizeof(uint32_t) || !allocate())
+        return false;
+
+    SLOT *slot = find(key,true);
+    if(slot == NULL){
+        dropped++;
+        return false;
+    }
+
+    uint32_t bits = 0;
+    memcpy(&bits,value,datasize);
+
+    // Take the slot, writers of one key are normally already serialized by the series lock
+    uint64_t version = slot->version.load(std::memory_order_relaxed);
+    while((version & 1) || !slot->version.compare_exchange_weak(version,version + 1,std::memory_order_acquire,std::memory_order_relaxed)){
+        if(version & 1)
+            version = slot->version.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if(slot->timestamp.load(std::memory_order_relaxed) <= timestamp){
+        slot->timestamp.store(timestamp,std::memory_order_relaxed);
+        slot->value.store(bits,std::memory_order_relaxed);
+    }
+
+    slot->version.store(version + 2,std::memory_order_release);
+
+    return true;
+}
+
+
+
+/// Consistent copy of a slot, retries while an update is writing it
+
+void BLatest::load(SLOT *slot, int64_t *timestamp, uint32_t *value){
+
+    uint64_t before, after;
+    do {
+        before = slot->version.load(std::memory_order_acquire);
+        *timestamp = slot->timestamp.load(std::memory_order_relaxed);
+        *value = slot->value.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = slot->version.load(std::memory_order_relaxed);
+    } while((before & 1) || before != after);
+}
+
+
+
+
+bool BLatest::get(uint32_t key, LATEST *out){
+
+    out->key = key;
+    out->timestamp = 0;
+    out->value.bits = 0;
+
+    SLOT *slot = find(key,false);
+    if(slot == NULL)
+        return false;
+
+    load(slot,&out->timestamp,&out->value.bits);
+
+    return out->timestamp != 0;
+}
+
+
+
+size_t BLatest::get(const uint32_t *keys, size_t n_keys, LATEST *out){
+
+    size_t found = 0;
+    for(size_t i = 0; i < n_keys; i++){
+        if(get(keys[i],&out[i]))
+            found++;
+    }
+    return found;
+}
+
+
+
+
+size_t BLatest::getAll(std::vector<LATEST> *out){
+
+    SLOT *table = slots.load(std::memory_order_acquire);
+    if(table == NULL)
+        return 0;
+
+    size_t found = 0;
+    out->reserve(out->size() + count);
+
+    for(size_t i = 0; i < capacity; i++){
+        uint64_t key = table[i].key.load(std::memory_order_acquire);
+        if(!key)
+            continue;
+
+        LATEST latest;
+        latest.key = key - 1;
+        load(&table[i],&latest.timestamp,&latest.value.bits);
+        if(!latest.timestamp)
+            continue;
+
+        out->push_back(latest);
+        found++;
+    }
+
+    return found;
+}
@@ -0,0 +1,83 @@
+#ifndef BLATEST_H
+#define BLATEST_H
+
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+
+
+#define LATEST_MAX_PROBE 64
+
+
+
+typedef struct
+{
+     uint32_t key;
+     int64_t timestamp; // nanoseconds, 0 = no value
+     union {
+          uint32_t bits;
+          float f; // datatype float
+          uint8_t u8; // datatype unsigned char
+     } value;
+} LATEST;
+
+
+
+
+/// Latest value of every series
+///
+/// An open addressed table of (key, timestamp, value). Every slot is a seqlock, an update makes the slot version odd,
+/// stores timestamp and value and makes it even again, readers retry until they copied both under the same even
+/// version so they never see a torn pair. Reads take no locks. Slots are never removed, keys stay once they have been written.
+/// A key is only ever placed within LATEST_MAX_PROBE slots of its hash, so a write to a key that is not in a full
+/// (or locally crowded) table gives up after that many probes and is counted in dropped.
+/// Values larger than 4 bytes are not kept.
+
+class BLatest
+{
+public:
+    BLatest();
+    ~BLatest();
+
+    bool setCapacity(size_t slots); // rounded up to a power of two, false once the first update allocated the table
+
+    bool update(uint32_t key, int64_t timestamp, const void *value, uint32_t datasize);
+
+    bool get(uint32_t key, LATEST *out);
+    size_t get(const uint32_t *keys, size_t n_keys, LATEST *out);
+    size_t getAll(std::vector<LATEST> *out);
+
+    size_t size() { return count; }
+
+    std::atomic<uint64_t> dropped; // updates that found no free slot within LATEST_MAX_PROBE
+
+private:
+    typedef struct
+    {
+         std::atomic<uint64_t> key; // key + 1, 0 = empty
+         std::atomic<uint64_t> version; // odd while an update is writing the slot
+         std::atomic<int64_t> timestamp;
+         std::atomic<uint32_t> value;
+    } SLOT;
+
+    void load(SLOT *slot, int64_t *timestamp, uint32_t *value);
+
+    SLOT* find(uint32_t key, bool insert);
+    bool allocate();
+
+    std::atomic<SLOT*> slots; // allocated by the first update
+    size_t capacity;
+    size_t mask;
+    std::atomic<size_t> count;
+
+    std::once_flag allocated;
+    std::mutex sizing; // capacity and mask only change before the table is allocated
+};
+
+
+#endif // BLATEST_H
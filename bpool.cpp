@@ -0,0 +1,118 @@
+#include "bpool.h"
+
+
+
+
+BRequestControl::BRequestControl(int64_t timeout_milliseconds)
+{
+    cancelled = false;
+    has_deadline = timeout_milliseconds > 0;
+    if(has_deadline)
+        deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_milliseconds);
+}
+
+
+bool BRequestControl::expired(){
+    return has_deadline && std::chrono::steady_clock::now() >= deadline;
+}
+
+
+
+
+BIOPool::BIOPool()
+{
+    threads = 4;
+    started = false;
+    stopped = false;
+}
+
+
+BIOPool::~BIOPool()
+{
+    stop();
+}
+
+
+
+
+void BIOPool::setThreads(unsigned int threads){
+
+    if(!threads)
+        threads = std::thread::hardware_concurrency();
+    if(!threads)
+        threads = 1;
+
+    this->threads = threads;
+}
+
+
+
+
+bool BIOPool::submit(std::function<void()> task){
+
+    {
+        std::lock_guard<std::mutex> lock(access);
+
+        if(stopped)
+            return false;
+
+        if(!started){
+            for(unsigned int i = 0; i < threads; i++)
+                workers.push_back(std::thread(&BIOPool::workerLoop,this));
+            started = true;
+        }
+
+        queue.push_back(std::move(task));
+    }
+
+    signal.notify_one();
+    return true;
+}
+
+
+size_t BIOPool::pending(){
+    std::lock_guard<std::mutex> lock(access);
+    return queue.size();
+}
+
+
+
+
+void BIOPool::workerLoop(){
+
+    while(true){
+
+        std::function<void()> task;
+
+        {
+            std::unique_lock<std::mutex> lock(access);
+            signal.wait(lock,[this]{ return stopped || !queue.empty(); });
+
+            if(queue.empty()) // Stopped and drained
+                return;
+
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        task();
+    }
+}
+
+
+
+
+void BIOPool::stop(){
+
+    {
+        std::lock_guard<std::mutex> lock(access);
+        stopped = true;
+    }
+    signal.notify_all();
+
+    for(size_t i = 0; i < workers.size(); i++){
+        if(workers[i].joinable())
+            workers[i].join();
+    }
+    workers.clear();
+}
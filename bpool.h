@@ -0,0 +1,74 @@
+#ifndef BPOOL_H
+#define BPOOL_H
+
+
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <deque>
+#include <vector>
+
+
+
+
+/// Cancellation and deadline of an async request, shared between the caller and the pool.
+/// A request that is cancelled or past its deadline when it reaches a pool thread completes without doing any I/O,
+/// one that is cancelled while running completes as cancelled and its result is released
+
+class BRequestControl
+{
+public:
+    BRequestControl(int64_t timeout_milliseconds = 0); // 0 = no deadline
+
+    void cancel() { cancelled = true; }
+    bool isCancelled() { return cancelled; }
+    bool expired();
+
+    std::atomic<bool> cancelled;
+    bool has_deadline;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+typedef std::shared_ptr<BRequestControl> REQUEST_CONTROL;
+
+
+
+
+/// Fixed size thread pool for blocking I/O
+///
+/// Tasks run in submission order on up to threads threads, the threads are started by the first submit
+/// so a pool that is never used costs nothing. stop() runs whatever is queued and joins the threads.
+
+class BIOPool
+{
+public:
+    BIOPool();
+    ~BIOPool();
+
+    void setThreads(unsigned int threads); // before the first submit, 0 = one per core
+
+    bool submit(std::function<void()> task); // false once stopped
+    size_t pending();
+
+    void stop();
+
+private:
+    void workerLoop();
+
+    std::mutex access;
+    std::condition_variable signal;
+    std::deque< std::function<void()> > queue;
+    std::vector<std::thread> workers;
+    unsigned int threads;
+    bool started;
+    bool stopped;
+};
+
+
+#endif // BPOOL_H
@@ -0,0 +1,622 @@
+#include "bseries.h"
+#include "debug.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <unistd.h>
+
+
+
+
+/// Quantile sketches
+///
+/// Float series can keep a <key>.qsk sidecar with a BQuantileSketch of every write_ahead_size block of data, so quantiles
+/// over long ranges merge one small sketch per block instead of reading every point. The sidecar is a header followed by
+/// records (block, bytes, sketch), later records replace earlier ones for the same block and an empty record marks a block
+/// whose sketch is stale. Appends write a fresh sketch of every block they touch, the partial last block is read back so its
+/// sketch covers the whole block. Direct writes only append an invalidation record, the sketch is rebuilt by the next query
+/// that needs it, so backfills do not rewrite a sketch per point. Blocks without a sketch (series written before sketches were
+/// enabled, sidecars lost in a snapshot) are built the same way, only for the blocks a query covers, the data is read
+/// without holding the series lock. Each series indexes the latest record of every block the first time it is queried and
+/// only scans what was appended since on later queries, so a query reads just the sketches it covers.
+/// The sidecar is rewritten without the replaced records once they outnumber the live ones.
+
+
+
+#define SKETCH_MAGIC 0x4B535142 // "BQSK"
+
+typedef struct
+{
+     uint32_t magic;
+     uint32_t block_bytes;
+     double alpha;
+} SKETCH_HEADER;
+
+typedef struct
+{
+     uint32_t block;
+     uint32_t bytes; // 0 = stale
+} SKETCH_RECORD;
+
+
+
+
+BFile* BSeries::openSketchFile(uint32_t key, bool writeMode){
+
+    char filename[256];
+    sprintf(filename,"%s/%u.qsk",data_directory,key);
+
+    return io->open(filename,writeMode);
+}
+
+
+
+
+static bool sketchHeaderValid(BFile *sketches, int64_t block_bytes, double alpha){
+    SKETCH_HEADER header;
+    return sketches->read(&header,sizeof(header),0) == sizeof(header) &&
+           header.magic == SKETCH_MAGIC && header.block_bytes == block_bytes && header.alpha == alpha;
+}
+
+
+static void resetSketchIndex(ENTRY *series){
+    series->sketch_index.clear();
+    series->sketch_indexed = 0;
+    series->sketch_records = 0;
+    series->sketch_blocks = 0;
+}
+
+
+static void appendRecord(string *records, int64_t block, const string &sketch){
+    SKETCH_RECORD record;
+    record.block = block;
+    record.bytes = sketch.size();
+    records->append((const char*)&record,sizeof(record));
+    records->append(sketch);
+}
+
+
+
+
+/// Opens the sidecar for appending, a missing sidecar or one written with other settings is started again
+/// (the blocks it described are rebuilt when queried)
+
+BFile* BSeries::openSketchesForAppend(uint32_t key, ENTRY *series){
+
+    int64_t block_bytes = (int64_t)write_ahead_size * series->header.datasize;
+
+    BFile *sketches = openSketchFile(key,true);
+    if(sketches == NULL){
+        _ERROR("\t Failed to open sketch file for series %u\n",key);
+        return NULL;
+    }
+
+    if(sketches->size() > 0 && sketchHeaderValid(sketches,block_bytes,sketch_accuracy))
+        return sketches;
+
+    delete sketches;
+
+    char filename[256];
+    sprintf(filename,"%s/%u.qsk",data_directory,key);
+    unlink(filename);
+    resetSketchIndex(series);
+
+    sketches = openSketchFile(key,true);
+    if(sketches == NULL)
+        return NULL;
+
+    SKETCH_HEADER header;
+    header.magic = SKETCH_MAGIC;
+    header.block_bytes = block_bytes;
+    header.alpha = sketch_accuracy;
+
+    if(sketches->write(&header,sizeof(header),0) != sizeof(header)){
+        delete sketches;
+        return NULL;
+    }
+
+    series->sketch_invalidated = 0;
+    return sketches;
+}
+
+
+
+
+/// Sketches every block touched by bytes of data appended at file offset
+
+void BSeries::appendSketches(uint32_t key, ENTRY *series, BFile *file, const char *data, int64_t offset, int64_t bytes){
+
+    if(!block_sketches || series->header.datatype != DATATYPE_FLOAT || series->header.datasize != sizeof(float) || bytes <= 0)
+        return;
+
+    BFile *sketches = openSketchesForAppend(key,series);
+    if(sketches == NULL)
+        return;
+
+    int64_t block_bytes = (int64_t)write_ahead_size * sizeof(float);
+    int64_t data_offset = offset - series->header_size;
+    int64_t first_block = data_offset / block_bytes;
+    int64_t last_block = (data_offset + bytes - 1) / block_bytes;
+
+    string records;
+    string sketch;
+
+    int64_t position = data_offset;
+    int64_t done = 0;
+    for(int64_t block = first_block; block <= last_block; block++){
+        int64_t in_block = position % block_bytes;
+        int64_t size = block_bytes - in_block;
+        if(size > bytes - done)
+            size = bytes - done;
+
+        BQuantileSketch s(sketch_accuracy);
+
+        if(in_block){ // The start of the block is already in the file
+            string head(in_block,0);
+            if(file->read(&head[0],in_block,offset - in_block) != in_block){
+                delete sketches;
+                return;
+            }
+            s.addFloats((const float*)head.data(),in_block / sizeof(float));
+        }
+        s.addFloats((const float*)(data + done),size / sizeof(float));
+
+        sketch.clear();
+        s.serialize(&sketch);
+        appendRecord(&records,block,sketch);
+
+        if(series->sketch_invalidated == block + 1)
+            series->sketch_invalidated = 0;
+
+        position += size;
+        done += size;
+    }
+
+    if(sketches->write(records.data(),records.size(),sketches->size()) != (int64_t)records.size())
+        _ERROR("\t Failed to write block sketches for series %u\n",key);
+
+    delete sketches;
+}
+
+
+
+
+/// Marks the blocks holding bytes overwritten in place at file offset as stale, repeated writes into the same block write one record
+
+void BSeries::invalidateSketches(uint32_t key, ENTRY *series, int64_t offset, int64_t bytes){
+
+    if(!block_sketches || series->header.datatype != DATATYPE_FLOAT || series->header.datasize != sizeof(float) || bytes <= 0)
+        return;
+
+    // Sketches being rebuilt from the file right now may have read the old data
+    series->sketch_generation++;
+
+    int64_t block_bytes = (int64_t)write_ahead_size * sizeof(float);
+    int64_t data_offset = offset - series->header_size;
+    int64_t first_block = data_offset / block_bytes;
+    int64_t last_block = (data_offset + bytes - 1) / block_bytes;
+
+    if(first_block == last_block && series->sketch_invalidated == first_block + 1)
+        return;
+
+    BFile *sketches = openSketchesForAppend(key,series);
+    if(sketches == NULL)
+        return;
+
+    string records;
+    for(int64_t block = first_block; block <= last_block; block++)
+        appendRecord(&records,block,string());
+
+    if(sketches->write(records.data(),records.size(),sketches->size()) == (int64_t)records.size()){
+        series->sketch_invalidated = last_block + 1;
+    } else {
+        _ERROR("\t Failed to invalidate block sketches for series %u\n",key);
+    }
+
+    delete sketches;
+}
+
+
+
+
+/// Reads the latest sketch of every block in [first_block, end_block) into sketches (empty if stale), series must be locked.
+/// Records appended since the last call are indexed first, returns false if there is no usable sidecar
+
+bool BSeries::loadSketches(uint32_t key, ENTRY *series, int64_t first_block, int64_t end_block, map<int64_t,string> *sketches){
+
+    BFile *file = openSketchFile(key,false);
+    if(file == NULL){
+        resetSketchIndex(series);
+        return false;
+    }
+
+    int64_t size = file->size();
+    if(size < (int64_t)sizeof(SKETCH_HEADER) || !sketchHeaderValid(file,(int64_t)write_ahead_size * series->header.datasize,sketch_accuracy)){
+        delete file;
+        resetSketchIndex(series);
+        return false;
+    }
+
+    if(series->sketch_indexed < (int64_t)sizeof(SKETCH_HEADER) || series->sketch_indexed > size){
+        resetSketchIndex(series);
+        series->sketch_indexed = sizeof(SKETCH_HEADER);
+    }
+
+    if(size > series->sketch_indexed){
+        string contents(size - series->sketch_indexed,0);
+        if(file->read(&contents[0],contents.size(),series->sketch_indexed) != (int64_t)contents.size()){
+            delete file;
+            return false;
+        }
+
+        size_t position = 0;
+        while(position + sizeof(SKETCH_RECORD) <= contents.size()){
+            SKETCH_RECORD record;
+            memcpy(&record,contents.data() + position,sizeof(record));
+
+            if(position + sizeof(record) + record.bytes > contents.size())
+                break; // Torn write at the end, the block is rebuilt
+
+            if(record.block >= series->sketch_index.size())
+                series->sketch_index.resize(record.block + 1,make_pair((int64_t)0,(uint32_t)0));
+            if(series->sketch_index[record.block].first == 0)
+                series->sketch_blocks++;
+
+            series->sketch_index[record.block] = make_pair(series->sketch_indexed + (int64_t)(position + sizeof(record)),record.bytes);
+            series->sketch_records++;
+            position += sizeof(record) + record.bytes;
+        }
+
+        series->sketch_indexed += position;
+    }
+
+    bool success = true;
+    for(int64_t block = first_block; block < end_block && block < (int64_t)series->sketch_index.size(); block++){
+        const pair<int64_t,uint32_t> &location = series->sketch_index[block];
+        if(location.first == 0)
+            continue;
+
+        string &sketch = (*sketches)[block];
+        sketch.resize(location.second);
+        if(location.second && file->read(&sketch[0],location.second,location.first) != location.second){
+            sketch.clear();
+            success = false;
+        }
+    }
+
+    delete file;
+    return success;
+}
+
+
+
+
+/// Builds the sketches of blocks from the data file, blocks must be complete blocks of the file.
+/// Runs without the series lock, the file is only read
+
+bool BSeries::rebuildSketches(uint32_t key, BFile **file, int64_t header_size, const vector<int64_t> &blocks, map<int64_t,string> *sketches){
+
+    if(*file == NULL && (*file = openFile(key,false)) == NULL)
+        return false;
+
+    int64_t block_bytes = (int64_t)write_ahead_size * sizeof(float);
+    string buffer(block_bytes,0);
+
+    for(size_t i = 0; i < blocks.size(); i++){
+        if((*file)->read(&buffer[0],block_bytes,header_size + blocks[i] * block_bytes) != block_bytes)
+            return false;
+
+        BQuantileSketch s(sketch_accuracy);
+        s.addFloats((const float*)buffer.data(),write_ahead_size);
+
+        string &sketch = (*sketches)[blocks[i]];
+        sketch.clear();
+        s.serialize(&sketch);
+    }
+
+    return true;
+}
+
+
+
+
+/// Appends rebuilt sketches to the sidecar, compacting it if it is mostly replaced records. series must be locked
+
+bool BSeries::storeSketches(uint32_t key, ENTRY *series, const map<int64_t,string> &sketches){
+
+    string added;
+    for(auto it = sketches.begin(); it != sketches.end(); it++){
+        appendRecord(&added,it->first,it->second);
+
+        if(series->sketch_invalidated == it->first + 1)
+            series->sketch_invalidated = 0;
+    }
+
+    if(series->sketch_records + (int64_t)sketches.size() <= 2 * series->sketch_blocks + 64){
+        BFile *sidecar = openSketchesForAppend(key,series);
+        if(sidecar == NULL)
+            return false;
+        bool success = sidecar->write(added.data(),added.size(),sidecar->size()) == (int64_t)added.size();
+        delete sidecar;
+        return success;
+    }
+
+
+    // Compact, write the live records to a new file and swap it in
+    map<int64_t,string> live;
+    loadSketches(key,series,0,series->sketch_index.size(),&live);
+    for(auto it = sketches.begin(); it != sketches.end(); it++)
+        live[it->first] = it->second;
+
+    string contents;
+
+    SKETCH_HEADER header;
+    header.magic = SKETCH_MAGIC;
+    header.block_bytes = (int64_t)write_ahead_size * sizeof(float);
+    header.alpha = sketch_accuracy;
+    contents.append((const char*)&header,sizeof(header));
+
+    for(auto it = live.begin(); it != live.end(); it++)
+        appendRecord(&contents,it->first,it->second);
+
+    char filename[256];
+    char temporary[256];
+    sprintf(filename,"%s/%u.qsk",data_directory,key);
+    sprintf(temporary,"%s/%u.qsk.tmp",data_directory,key);
+    unlink(temporary);
+
+    BFile *compacted = io->open(temporary,true);
+    if(compacted == NULL)
+        return false;
+
+    bool success = compacted->write(contents.data(),contents.size(),0) == (int64_t)contents.size();
+    delete compacted;
+
+    if(success)
+        success = rename(temporary,filename) == 0;
+    if(!success)
+        unlink(temporary);
+
+    resetSketchIndex(series);
+    return success;
+}
+
+
+
+
+/// Adds every point of one series in [start_time, end_time) to sketch (or to exact_values when given).
+/// Complete blocks inside the range are taken from their sketches, the edges and the write ahead tail are read raw
+
+int BSeries::quantileSeries(uint32_t key, int64_t start_time, int64_t end_time, BQuantileSketch *sketch, vector<float> *exact_values, char *buffer){
+
+    index_access.lock();
+    ENTRY *series = &series_list[key];
+    index_access.unlock();
+
+    BFile *file = NULL;
+
+    series->access.lock();
+
+    int status = loadHeader(key,series,&file);
+    if(status == NO_ERROR && (series->header.datatype != DATATYPE_FLOAT || series->header.datasize != sizeof(float)))
+        status = INVALID_DATATYPE;
+    if(status != NO_ERROR){
+        series->access.unlock();
+        if(file)
+            delete file;
+        return status;
+    }
+
+    // Nanoseconds from here on
+    start_time *= NS_PER_SECOND;
+    end_time *= NS_PER_SECOND;
+
+    int64_t timestamp = series->header.timestamp;
+    int64_t interval = series->header.interval;
+    int64_t points_in_file = (series->file_size - series->header_size) / sizeof(float);
+    int64_t last_point = points_in_file + (series->write_ahead_cache != NULL ? series->cache_points : 0);
+
+    // Points whose timestamps fall in [start_time, end_time)
+    int64_t first = start_time <= timestamp ? 0 : (start_time - timestamp + interval - 1) / interval;
+    int64_t end = end_time <= timestamp ? 0 : (end_time - timestamp + interval - 1) / interval;
+    if(end > last_point)
+        end = last_point;
+
+    // Complete blocks of the file inside the range
+    int64_t first_block = (first + write_ahead_size - 1) / write_ahead_size;
+    int64_t end_block = (end < points_in_file ? end : points_in_file) / write_ahead_size;
+
+    map<int64_t,string> sketches;
+    vector<int64_t> missing;
+    int64_t header_size = series->header_size;
+    uint64_t generation = series->sketch_generation;
+
+    if(exact_values != NULL || !block_sketches || end_block <= first_block){
+        end_block = first_block;
+    } else {
+        loadSketches(key,series,first_block,end_block,&sketches);
+
+        for(int64_t block = first_block; block < end_block; block++){
+            auto found = sketches.find(block);
+            if(found == sketches.end() || found->second.empty())
+                missing.push_back(block);
+        }
+    }
+
+    series->access.unlock();
+
+    // Missing sketches are built without the lock and only stored if no direct write changed the series meanwhile,
+    // blocks that fail to build are read raw below
+    if(!missing.empty()){
+        map<int64_t,string> rebuilt;
+        if(rebuildSketches(key,&file,header_size,missing,&rebuilt)){
+            for(auto it = rebuilt.begin(); it != rebuilt.end(); it++)
+                sketches[it->first] = it->second;
+
+            lock_guard<mutex> lock(series->access);
+            if(generation == series->sketch_generation && !storeSketches(key,series,rebuilt))
+                _WARN("\t Failed to store rebuilt sketches for series %u\n",key);
+        }
+    }
+
+    if(file)
+        delete file;
+
+
+    // Point ranges read raw
+    vector< pair<int64_t,int64_t> > raw;
+
+    if(end_block > first_block){
+        raw.push_back(make_pair(first,first_block * write_ahead_size));
+        raw.push_back(make_pair(end_block * write_ahead_size,end));
+
+        for(int64_t block = first_block; block < end_block; block++){
+            const string &s = sketches[block];
+            if(s.empty() || !sketch->deserialize(s.data(),s.size()))
+                raw.push_back(make_pair(block * write_ahead_size,(block + 1) * write_ahead_size));
+        }
+    } else {
+        raw.push_back(make_pair(first,end));
+    }
+
+    for(size_t r = 0; r < raw.size(); r++){
+        for(int64_t point = raw[r].first; point < raw[r].second; point += write_ahead_size){
+            int64_t n = raw[r].second - point < write_ahead_size ? raw[r].second - point : write_ahead_size;
+
+            int64_t n_points = 0, real_points = 0, read_interval = 0, first_point_timestamp = 0;
+            uint32_t datasize = 0;
+            void *result = NULL;
+
+            status = readNs(key,timestamp + point * interval,timestamp + (point + n) * interval,&n_points,&real_points,&read_interval,&first_point_timestamp,&datasize,&result,buffer,write_ahead_size);
+            if(status != NO_ERROR)
+                return status;
+
+            const float *values = (const float*)buffer;
+            if(exact_values == NULL){
+                sketch->addFloats(values,n_points);
+            } else {
+                for(int64_t i = 0; i < n_points; i++){
+                    if(values[i] == values[i])
+                        exact_values->push_back(values[i]);
+                }
+            }
+        }
+    }
+
+    return NO_ERROR;
+}
+
+
+
+
+void BSeries::quantileWorker(QUANTILE_JOB *job){
+
+    {
+        lock_guard<mutex> lock(job->access);
+        if(job->closed)
+            return;
+        job->running++;
+    }
+
+    BQuantileSketch sketch(sketch_accuracy);
+    vector<float> values;
+
+    char *buffer = (char*)malloc((int64_t)write_ahead_size * sizeof(float));
+    if(buffer == NULL){
+        job->failed++;
+    } else {
+        size_t i;
+        while((i = job->next++) < job->n_keys){
+            if(quantileSeries(job->keys[i],job->start_time,job->end_time,&sketch,job->exact ? &values : NULL,buffer) != NO_ERROR)
+                job->failed++;
+        }
+
+        free(buffer);
+    }
+
+    lock_guard<mutex> lock(job->access);
+    job->total.merge(sketch);
+    if(job->exact)
+        job->exact_values.insert(job->exact_values.end(),values.begin(),values.end());
+
+    job->running--;
+    job->finished.notify_all();
+}
+
+
+
+
+/// Quantiles of every non null point of the float series in keys between start_time and end_time, "p99 latency over 30 days"
+///
+/// out[i] is the q[i] quantile (0..1, the value at rank q * (count - 1)) or NaN if there are no points.
+/// With block_sketches set every result is within a relative error of sketch_accuracy of the exact value:
+/// |out[i] - exact| <= sketch_accuracy * |exact|, values closer to zero than 1e-9 are reported as 0.
+/// With exact set the points are read and sorted instead, use it to check the sketches or when the range is small.
+/// Series that can not be read (or are not float series) are skipped and counted in skipped.
+/// Runs on the calling thread and up to threads - 1 tasks on read_pool (threads 0 = one per core), like readGroupAggregate.
+/// Returns NO_ERROR, INVALID_TIME_RANGE, or -1 while the database is shutting down
+
+int BSeries::readQuantiles(const uint32_t *keys, size_t n_keys, int64_t start_time, int64_t end_time, const double *q, size_t n_q, double *out, size_t *skipped, bool exact, unsigned int threads){
+
+    if(shuttingDown)
+        return -1;
+
+    if(end_time <= 0)
+        end_time = time(NULL);
+
+    if(start_time <= 0 || start_time >= end_time)
+        return INVALID_TIME_RANGE;
+
+    shared_ptr<QUANTILE_JOB> job(new QUANTILE_JOB());
+    job->keys = keys;
+    job->n_keys = n_keys;
+    job->start_time = start_time;
+    job->end_time = end_time;
+    job->exact = exact;
+    job->total = BQuantileSketch(sketch_accuracy);
+
+    if(!threads)
+        threads = thread::hardware_concurrency();
+    if(!threads)
+        threads = 1;
+    if(threads > n_keys)
+        threads = n_keys;
+
+    for(unsigned int i = 1; i < threads; i++){
+        if(!read_pool.submit([this,job](){ quantileWorker(job.get()); }))
+            break;
+    }
+
+    quantileWorker(job.get()); // This thread is a worker too
+
+    // Tasks still queued find the job closed, wait for the ones that started
+    {
+        unique_lock<mutex> lock(job->access);
+        job->closed = true;
+        job->finished.wait(lock,[&job]{ return job->running == 0; });
+    }
+
+    BQuantileSketch &total = job->total;
+    vector<float> &exact_values = job->exact_values;
+
+
+    if(exact)
+        sort(exact_values.begin(),exact_values.end());
+
+    for(size_t i = 0; i < n_q; i++){
+        if(!exact){
+            out[i] = total.quantile(q[i]);
+        } else if(exact_values.empty()){
+            out[i] = NAN;
+        } else {
+            double rank = q[i] < 0 ? 0 : (q[i] > 1 ? 1 : q[i]);
+            out[i] = exact_values[(size_t)(rank * (exact_values.size() - 1))];
+        }
+    }
+
+    if(skipped)
+        *skipped = job->failed;
+
+    return NO_ERROR;
+}
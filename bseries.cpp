@@ -1,5 +1,8 @@
 #include "bseries.h"
 #include "debug.h"
+#include "crc32c.h"
+
+#include <stddef.h>
 
 
 
@@ -13,34 +16,218 @@ BSeries::BSeries()
 
     this->shuttingDown = false;
 
+    this->io = &default_io;
+
+    this->flush_threads = 0;
+    this->last_flush_ms = 0;
+    this->last_flush_bytes = 0;
+
+    this->block_checksums = false;
+    this->verify_on_read = false;
+    this->checksum_errors = 0;
+
+    this->block_sketches = false;
+    this->sketch_accuracy = 0.01;
+
+    this->scrubbing = false;
+    this->scrub_rate = 0;
+    this->scrub_interval = 0;
+    this->scrub_bytes = 0;
+    this->scrub_blocks = 0;
+    this->scrub_passes = 0;
+
+    this->snapshot_epoch = 0;
+    this->snapshot_active = false;
+
 }
 
 
 
 uint32_t BSeries::getChecksum(SERIES *series){
+    return 1234567890 + crc32c(0,series,offsetof(SERIES,checksum));
+}
+
+
+uint32_t BSeries::getChecksum(SERIES_V1 *series){
     return 1234567890 + ((series->version ^ series->timestamp) ^ (series->interval ^ series->datasize));
 }
 
 
-int BSeries::createSeries(FILE *file, SERIES *series, uint32_t datasize){
+static uint32_t defaultDatatype(uint32_t datasize){
+    if(datasize == sizeof(float))
+        return DATATYPE_FLOAT;
+    if(datasize == sizeof(uint8_t))
+        return DATATYPE_UNSIGNED;
+    return DATATYPE_BINARY;
+}
+
+
+/// Writes a new version 2 header (version 3 when the I/O backend wants aligned writes), timestamp and interval are nanoseconds,
+/// 0 = the current second and default_seconds_per_point
+
+int BSeries::createSeries(BFile *file, ENTRY *series, uint32_t datasize, int64_t timestamp, int64_t interval, uint32_t datatype){
 
-    series->version = 1;
-    series->timestamp = time(NULL);
-    series->interval = default_seconds_per_point;
-    series->datasize = datasize;
-    series->checksum = getChecksum(series);
+    SERIES *header = &series->header;
 
-    fseek(file,0,SEEK_SET);
-    int64_t size = fwrite((char*)series,sizeof(SERIES),1,file);
+    bool aligned = io->writeAlignment() > 0;
 
+    header->version = aligned ? SERIES_VERSION_ALIGNED : SERIES_VERSION;
+    header->datasize = datasize;
+    header->timestamp = timestamp ? timestamp : (int64_t)time(NULL) * NS_PER_SECOND;
+    header->interval = interval > 0 ? interval : (int64_t)default_seconds_per_point * NS_PER_SECOND;
+    header->datatype = datatype == DATATYPE_DEFAULT ? defaultDatatype(datasize) : datatype;
+    header->checksum = getChecksum(header);
 
-    if(size == 1)
+    series->header_size = aligned ? SERIES_ALIGNED_DATA_OFFSET : sizeof(SERIES);
+    series->points.set(header->interval);
+
+    int64_t size = -1;
+    char *raw = (char*)io->allocBuffer(series->header_size);
+    if(raw != NULL){
+        memset(raw,0,series->header_size);
+        memcpy(raw,header,sizeof(SERIES));
+        size = file->write(raw,series->header_size,0);
+        io->freeBuffer(raw);
+    }
+
+    if(size == series->header_size)
         return 1;
 
+    header->checksum = ~header->checksum; // Not loaded
     return 0;
 }
 
 
+/// Reads the header of a data file, version 1 headers are converted to nanoseconds. header_size is set to the bytes before the first point.
+/// Returns NO_ERROR, FAILED_TO_READ_HEADER if the file is too short or INVALID_HEADER_CHECKSUM
+
+int BSeries::parseHeader(BFile *file, SERIES *parsed, int64_t *header_size){
+
+    char raw[sizeof(SERIES)];
+    int64_t size = file->read(raw,sizeof(raw),0);
+
+    uint32_t version = 0;
+    if(size >= (int64_t)sizeof(version))
+        memcpy(&version,raw,sizeof(version));
+
+    SERIES header;
+
+    if(version == 1 && size >= (int64_t)sizeof(SERIES_V1)){
+        SERIES_V1 v1;
+        memcpy(&v1,raw,sizeof(v1));
+        if(v1.checksum != getChecksum(&v1))
+            return INVALID_HEADER_CHECKSUM;
+
+        header.version = 1;
+        header.datasize = v1.datasize;
+        header.timestamp = (int64_t)v1.timestamp * NS_PER_SECOND;
+        header.interval = (int64_t)v1.interval * NS_PER_SECOND;
+        header.datatype = defaultDatatype(v1.datasize);
+        header.checksum = getChecksum(&header);
+        *header_size = sizeof(SERIES_V1);
+    } else if(size == sizeof(SERIES)){
+        memcpy(&header,raw,sizeof(header));
+        if((header.version != SERIES_VERSION && header.version != SERIES_VERSION_ALIGNED) || header.checksum != getChecksum(&header))
+            return INVALID_HEADER_CHECKSUM;
+        *header_size = header.version == SERIES_VERSION_ALIGNED ? SERIES_ALIGNED_DATA_OFFSET : sizeof(SERIES);
+    } else {
+        return FAILED_TO_READ_HEADER;
+    }
+
+    if(header.interval <= 0 || header.datasize == 0)
+        return INVALID_HEADER_CHECKSUM;
+
+    *parsed = header;
+
+    return NO_ERROR;
+}
+
+
+/// Loads the header of a series for writing, a series without a header is created with the given layout.
+/// series must be locked, returns NO_ERROR, INTERNAL_ERROR if the file can not be opened, CREATE_NEW_HEADER_FAIL or HEADER_INVALID_CHECKSUM
+
+int BSeries::openSeries(uint32_t key, ENTRY *series, BFile **file, uint32_t datasize, int64_t timestamp, int64_t interval, uint32_t datatype){
+
+    if(series->header.checksum == getChecksum(&series->header))
+        return NO_ERROR;
+
+    _DEBUG("\t INVALID CACHED HEADER, READING HEADER FROM FILE\n");
+
+    if(*file == NULL && (*file = openFile(key,true)) == NULL){
+        _ERROR("\t Failed to open or create file");
+        return INTERNAL_ERROR;
+    }
+
+    int status = parseHeader(*file,&series->header,&series->header_size);
+    if(status == NO_ERROR)
+        series->points.set(series->header.interval);
+
+    // If the header not read correctily, create the series
+    if(status == FAILED_TO_READ_HEADER){
+        if(!createSeries(*file,series,datasize,timestamp,interval,datatype)){
+            _ERROR("\t Failed to create new File/header\n");
+            return CREATE_NEW_HEADER_FAIL;
+        }
+        _DEBUG("\t Created New File\n");
+        status = NO_ERROR;
+    }
+
+    if(status != NO_ERROR){
+        _ERROR("\t HEADER_INVALID_CHECKSUM\n");
+        return HEADER_INVALID_CHECKSUM;
+    }
+
+    // Get our file size, we get the file size whenver we open a new file, when we update a file we also update the filesize
+    series->file_size = (*file)->size();
+    _DEBUG("\tFile size = %u\n",series->file_size);
+
+    return NO_ERROR;
+}
+
+
+/// Creates a series with an explicit layout, for sub second intervals and typed values.
+/// interval and timestamp (the first point, 0 = the current second) are nanoseconds.
+/// Returns NO_ERROR if the series was created or already exists with this layout, INVALID_DATATYPE if the
+/// datatype and datasize do not go together or the series exists with another layout, INVALID_TIME_RANGE for a bad interval
+
+int BSeries::defineSeries(uint32_t key, uint32_t datatype, uint32_t datasize, int64_t interval, int64_t timestamp){
+
+    if(shuttingDown)
+        return -1;
+
+    if(interval <= 0 || timestamp < 0)
+        return INVALID_TIME_RANGE;
+
+    bool integer_size = datasize == 1 || datasize == 2 || datasize == 4 || datasize == 8;
+    bool valid = datasize > 0 && ((datatype == DATATYPE_FLOAT && (datasize == 4 || datasize == 8)) ||
+                                  ((datatype == DATATYPE_SIGNED || datatype == DATATYPE_UNSIGNED) && integer_size) ||
+                                  datatype == DATATYPE_BINARY || datatype == DATATYPE_DEFAULT);
+    if(!valid)
+        return INVALID_DATATYPE;
+
+    index_access.lock();
+    ENTRY *series = &series_list[key];
+    index_access.unlock();
+
+    BFile *file = NULL;
+
+    series->access.lock();
+    freezeForSnapshot(key,series);
+
+    int status = openSeries(key,series,&file,datasize,timestamp,interval,datatype);
+    if(status == NO_ERROR && (series->header.datasize != datasize || series->header.interval != interval ||
+       (datatype != DATATYPE_DEFAULT && series->header.datatype != datatype)))
+        status = INVALID_DATATYPE;
+
+    series->access.unlock();
+
+    if(file)
+        delete file;
+
+    return status;
+}
+
+
 
 
 
@@ -92,7 +279,7 @@ bool BSeries::trim(){
 
 
 
-FILE* BSeries::openFile(uint64_t key, bool writeMode){
+BFile* BSeries::openFile(uint64_t key, bool writeMode){
 
 
 
@@ -101,43 +288,40 @@ FILE* BSeries::openFile(uint64_t key, bool writeMode){
     sprintf(filename,"%s/%u",data_directory,key);
 
 
-    FILE *file = fopen(filename,"r+b");
-
-    if(file == NULL && writeMode){ // Try Again, append binary
-        file = fopen(filename,"ab");
-    }
-
-
-    return file;
+    // Opens read/write, if writeMode is set the file is created when missing
+    return io->open(filename,writeMode);
 
 }
 
 
 
-bool BSeries::flushBuffer(ENTRY *series,FILE *file){
+bool BSeries::flushBuffer(uint32_t key, ENTRY *series,BFile *file){
 
     if(file == NULL || series->write_ahead_cache == NULL)
         return false;
 
+    if(series->cache_points <= 0) // Nothing written to the buffer yet
+        return true;
 
-    _DEBUG("\tSeeking to end of file\n");
-    // Seek to end of file
-    fseek(file,0,SEEK_END);
 
     _DEBUG("\tFlushing current buffer\n");
-    // Write are buffer to the file
-    size_t size = fwrite(series->write_ahead_cache,series->header.datasize,write_ahead_size,file); // Write the data point
+    // Write the populated part of our buffer to the end of the file, the rest is null fill and the next write will land there anyway
+    int64_t bytes = series->cache_points * series->header.datasize;
+    int64_t size = file->write(series->write_ahead_cache,bytes,series->file_size);
 
-    if(size != write_ahead_size){
+    if(size != bytes){
         _ERROR("\t Failed to flush write ahead buffer to file");
         return false;
     }
-    series->file_size += write_ahead_size * series->header.datasize; // Our file has grown!
+    fileAppended(key,series,file,series->write_ahead_cache,series->file_size,size);
+
+    series->file_size += bytes; // Our file has grown!
     _DEBUG("\tNew File Size = %d\n",series->file_size);
 
 
     // Reset our buffer with null fill
-    memset(series->write_ahead_cache,default_null_fill_byte,write_ahead_size * series->header.datasize);
+    memset(series->write_ahead_cache,default_null_fill_byte,bytes);
+    series->cache_points = 0;
 
     return true;
 }
@@ -145,11 +329,31 @@ bool BSeries::flushBuffer(ENTRY *series,FILE *file){
 
 
 
+/// Number of cache points that make up the next flush. write_ahead_size, unless the backend wants aligned writes and
+/// the end of the file is off the alignment (after a partial flush), then the first flush is cut short so the file
+/// ends on the alignment again and the flushes after it are aligned
+
+int64_t BSeries::flushPoints(ENTRY *series){
+
+    int64_t alignment = io->writeAlignment();
+    if(alignment <= 0 || series->file_size % alignment == 0)
+        return write_ahead_size;
+
+    int64_t gap = alignment - series->file_size % alignment;
+    if(gap % series->header.datasize || gap / series->header.datasize >= write_ahead_size)
+        return write_ahead_size;
+
+    return gap / series->header.datasize;
+}
+
+
+
+
 bool BSeries::validateWriteAheadCache(ENTRY *series){
 
     // If our write ahead cache is NULL, malloc it and set it to our null fill
     if(series->write_ahead_cache == NULL){
-        series->write_ahead_cache = (char*)malloc(write_ahead_size * series->header.datasize);
+        series->write_ahead_cache = (char*)io->allocBuffer(write_ahead_size * series->header.datasize);
 
         if(series->write_ahead_cache == NULL){
             _ERROR("Cache Malloc Failed, Fatal!\n");
@@ -165,6 +369,130 @@ bool BSeries::validateWriteAheadCache(ENTRY *series){
 }
 
 
+/// Keeps checksums and the read cache in step with the data file, called after bytes were appended at file offset
+
+void BSeries::fileAppended(uint32_t key, ENTRY *series, BFile *file, const char *data, int64_t offset, int64_t bytes){
+
+    // Only complete blocks are cached and appends only complete the partial last block, nothing to invalidate
+    appendChecksums(key,series,file,data,offset,bytes);
+    appendSketches(key,series,file,data,offset,bytes);
+}
+
+
+/// Called after bytes at file offset were overwritten in place
+
+void BSeries::fileRewritten(uint32_t key, ENTRY *series, BFile *file, int64_t offset, int64_t bytes){
+
+    int64_t block_bytes = (int64_t)write_ahead_size * series->header.datasize;
+    int64_t data_offset = offset - series->header_size;
+
+    read_cache.invalidate(key,data_offset / block_bytes,(data_offset + bytes - 1) / block_bytes);
+    rewriteChecksums(key,series,file,offset,bytes);
+    invalidateSketches(key,series,offset,bytes);
+}
+
+
+
+
+/// Reads n_points starting at first_point from the data file into output, returns the number of points read or an error.
+///
+/// Without the read cache or verification this is a single read. Otherwise the region is read block by block,
+/// complete blocks come from the read cache when they can, blocks read from disk are verified (verify_on_read)
+/// and added to the cache. file is opened when the first block has to come from disk.
+/// file_size and header_size are what the caller saw under the series lock, the lock only has to be held when verify_on_read is set
+
+int64_t BSeries::readRegion(uint32_t key, ENTRY *series, int64_t header_size, uint32_t datasize, int64_t file_size, BFile **file, char *output, int64_t first_point, int64_t n_points){
+
+    if(!read_cache.enabled() && !verify_on_read){
+        if(*file == NULL && (*file = openFile(key,false)) == NULL)
+            return FAILED_TO_OPEN_FILE;
+
+        int64_t bytes = (*file)->read(output,n_points * datasize,first_point * datasize + header_size);
+        return bytes > 0 ? bytes / datasize : 0;
+    }
+
+
+    int64_t data_bytes = file_size - header_size;
+    int64_t block_bytes = (int64_t)write_ahead_size * datasize;
+
+    // Blocks read while a direct write invalidates them are not cached
+    uint64_t generation = read_cache.generation(key);
+
+    int64_t start = first_point * datasize;
+    int64_t end = start + n_points * datasize;
+    if(end > data_bytes)
+        end = data_bytes;
+
+    BFile *checksums = NULL;
+    bool checksums_opened = false;
+    char *buffer = NULL;
+    int64_t copied = 0;
+
+    for(int64_t block = start / block_bytes; block * block_bytes < end; block++){
+
+        int64_t block_start = block * block_bytes;
+        int64_t from = block_start > start ? block_start : start;
+        int64_t to = block_start + block_bytes < end ? block_start + block_bytes : end;
+        bool complete = block_start + block_bytes <= data_bytes;
+
+        if(complete && read_cache.get(key,block,output + (from - start),from - block_start,to - from)){
+            copied += to - from;
+            continue;
+        }
+
+        // From disk, the whole block so it can be verified and cached
+        if(*file == NULL && (*file = openFile(key,false)) == NULL){
+            copied = FAILED_TO_OPEN_FILE;
+            break;
+        }
+
+        if(buffer == NULL && (buffer = (char*)malloc(block_bytes)) == NULL){
+            copied = MEMORY_ALLOCATION_FAILED;
+            break;
+        }
+
+        if(verify_on_read && !checksums_opened){
+            checksums = openVerifiedChecksums(key,series,*file);
+            checksums_opened = true;
+        }
+
+        int64_t size = 0;
+        int result = -1;
+        if(checksums != NULL)
+            result = checkBlock(*file,checksums,header_size,datasize,data_bytes,block,buffer,&size);
+
+        if(result == 0){
+            _ERROR("\t Block %ld of series %u failed checksum verification\n",(long)block,key);
+            checksum_errors++;
+            copied = BLOCK_CHECKSUM_MISMATCH;
+            break;
+        }
+
+        if(result < 0){ // Not verified, plain read
+            size = data_bytes - block_start;
+            if(size > block_bytes)
+                size = block_bytes;
+            if((*file)->read(buffer,size,header_size + block_start) != size)
+                break;
+        }
+
+        if(complete)
+            read_cache.put(key,block,buffer,block_bytes,generation);
+
+        memcpy(output + (from - start),buffer + (from - block_start),to - from);
+        copied += to - from;
+    }
+
+    free(buffer);
+    if(checksums)
+        delete checksums;
+
+    return copied >= 0 ? copied / datasize : copied;
+}
+
+
+
+
 /// This function takes a filename and value
 /// it reads the header of the file and determins where the point needs to be written based on the current timestamp
 /// if the files is missing a new file is created
@@ -187,13 +515,24 @@ bool BSeries::validateWriteAheadCache(ENTRY *series){
 
 int BSeries::write(uint32_t key, void *value,uint32_t datasize, uint32_t timestamp){
 
+    if(!timestamp)
+        timestamp = time(NULL);
+
+    return writeNs(key,value,datasize,(int64_t)timestamp * NS_PER_SECOND);
+}
+
+
+/// write() with a nanosecond timestamp, 0 = now
+
+int BSeries::writeNs(uint32_t key, void *value,uint32_t datasize, int64_t timestamp){
+
     if(shuttingDown) // We lock mutexes after the database is shutdown, some writes could hang here trying to lock the mutex so we force return
         return -1;
 
 
     _DEBUG("Looking Up Key: %d\n",key);
 
-    FILE *file = NULL;
+    BFile *file = NULL;
 
 
     index_access.lock();
@@ -215,12 +554,13 @@ int BSeries::write(uint32_t key, void *value,uint32_t datasize, uint32_t timesta
     uint32_t status = NO_ERROR;
 
     if(!timestamp)
-        timestamp = time(NULL);
+        timestamp = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
 
     do {
         series->access.lock();
+        freezeForSnapshot(key,series);
 
-        int size;
+        int64_t size;
 
         _DEBUG("Writing to series %u\n",key);
 
@@ -233,49 +573,15 @@ int BSeries::write(uint32_t key, void *value,uint32_t datasize, uint32_t timesta
 
 
         // Check if we have a falid header, if not open the file and check for a valid header, if still no valid header create one
-
-        if(series->header.checksum != getChecksum(&series->header)){// cached checksum header is invalid, read it from the file
-            _DEBUG("\t INVALID CACHED HEADER, READING HEADER FROM FILE\n");
-
-
-            file = openFile(key,true);
-
-            if(file == NULL){
-                _ERROR("\t Failed to open or create file");
-                break;
-            }
-
-            // read our header
-            size = fread((char*)&series->header,sizeof(series->header),1,file);
-
-
-            // If the header not read correctily, create the series
-            if(size != 1){
-                /// Create header and continue write
-                if(!createSeries(file,&series->header,datasize)){ // attempt to create header, if failure, return error
-                    fclose(file);
-                    _ERROR("\t Failed to create new File/header\n");
-                    status = CREATE_NEW_HEADER_FAIL;
-                    break;
-                }
-                _DEBUG("\t Created New File\n");
-            }
-
-
-
-            // check the checksum once more, if incorrect, close the file
-            if(series->header.checksum != getChecksum(&series->header)){
-                fclose(file);
-                _ERROR("\t HEADER_INVALID_CHECKSUM\n");
-                status = HEADER_INVALID_CHECKSUM;
-                break;
-            }
+        status = openSeries(key,series,&file,datasize);
+        if(status != NO_ERROR)
+            break;
 
 
-            // Get our file size, we get the file size whenver we open a new file, when we update a file we also update the filesize
-            fseek(file,0,SEEK_END);
-            series->file_size = ftell(file);
-            _DEBUG("\tFile size = %u\n",series->file_size);
+        if(timestamp < series->header.timestamp){
+            _ERROR("\t Write to series %u before its first point\n",key);
+            status = INTERNAL_ERROR;
+            break;
         }
 
 
@@ -293,10 +599,10 @@ int BSeries::write(uint32_t key, void *value,uint32_t datasize, uint32_t timesta
 
 retry:
 
-        int64_t point = (timestamp - series->header.timestamp)/series->header.interval;
+        int64_t point = series->points.divide(timestamp - series->header.timestamp);
         // Point since start of file
 
-        int64_t file_pos = point * series->header.datasize + sizeof(SERIES);
+        int64_t file_pos = point * series->header.datasize + series->header_size;
 
 
         if(file_pos >= series->file_size){ // Cached Write
@@ -304,7 +610,7 @@ retry:
             _DEBUG("\t ===== Performing Cached Write =======\n");
 
             // get total points in series
-            int64_t pointsInBuffer = point - ((series->file_size - sizeof(SERIES)) / series->header.datasize);
+            int64_t pointsInBuffer = point - ((series->file_size - series->header_size) / series->header.datasize);
             //a int64_t pointsInBuffer = pointsInSeries - point;
 
             _DEBUG("\t Absolute point in series: %d,  buffer pos: %d, buffer size: %d\n",point,pointsInBuffer,write_ahead_size);
@@ -314,9 +620,11 @@ retry:
             if(pointsInBuffer < write_ahead_size){
                 // Write to buffer
                 memcpy(series->write_ahead_cache + (pointsInBuffer * series->header.datasize),value,series->header.datasize);
+                if(pointsInBuffer >= series->cache_points)
+                    series->cache_points = pointsInBuffer + 1;
                 _DEBUG("\t Writing to buffer at pos: %d\n",pointsInBuffer);
 
-                if(pointsInBuffer == (write_ahead_size-1)){ // If we've reached the end of our buffer, flush it.
+                if(pointsInBuffer >= flushPoints(series) - 1){ // If we've reached the end of our buffer, flush it.
                     // flush write ahead to file
                     _DEBUG("\t Buffer is full, flushing to disk\n");
 
@@ -324,7 +632,7 @@ retry:
                     if(file == NULL)
                         file = openFile(key,true);
 
-                    if(!flushBuffer(series,file)){
+                    if(!flushBuffer(key,series,file)){
                         _DEBUG("\t Failed to flush buffer");
                         break;
                     }
@@ -347,39 +655,27 @@ retry:
 
 
                 // First flush our current buffer to disk because it could contain some valid points
-                if(!flushBuffer(series,file)){
+                int64_t flushed_points = series->cache_points;
+                if(!flushBuffer(key,series,file)){
                     _DEBUG("\t Failed to flush buffer");
                     break;
                 }
 
 
 
-                // How many null points do we need to insert?... Measure from end of write ahead pos to where we want to be
-                int64_t grow_by = (pointsInBuffer - write_ahead_size); // Calculate how many bytes we are going to grow the file, we want write_ahead_size beyond the current requested write position
+                // How many null points do we need to insert?... Measure from end of the flushed points to where we want to be
+                int64_t grow_by = (pointsInBuffer - flushed_points); // Calculate how many points we are going to grow the file, the requested write position becomes the start of the write ahead cache
                 _DEBUG("\t Adding %u null points\n",grow_by);
 
+                if(grow_by <= 0)
+                    goto retry;
 
-                // Create a temporary buffer to hold the data
-                char *nullFill = (char*)malloc(grow_by * series->header.datasize); // Allocate a temporary memory buffer to contain the null data points that we will write
-                if(nullFill == NULL){ // Could not allocate memory
-                    _ERROR("\t WAL_MEMORY_ALLOCATION_FAILURE\n");
-                    break;
-                }
-
-                // Set the buffer to our null fill
-                memset(nullFill,0xFF,grow_by * series->header.datasize); // Set to the null fill, for char a value of '0' is used, for float a value of 'FFFFFFFF' is used which represents 'Nan'
 
-                _DEBUG("\Writing null fill to end of file\n");
-                // Write it to disk
-                if(fwrite(nullFill,series->header.datasize,grow_by,file) != grow_by){ // Write the null points
-                    free(nullFill);
+                // Null fill up to the requested write position, the same fill and aligned buffers as writeRangeNs
+                if(!appendPoints(key,series,file,NULL,grow_by)){
                     _ERROR("\t WAL_WRITE_FAILURE\n");
                     break;
                 }
-                _DEBUG("\t freeing null buffer\n");
-                free(nullFill);
-
-                series->file_size += grow_by * series->header.datasize; // Our new filesize
                 _DEBUG("\tNew File Size = %d\n",series->file_size);
 
 
@@ -404,23 +700,28 @@ retry:
                 }
             }
 
-            _DEBUG("\t seeking to current writing position: %d\n",file_pos);
-            fseek(file,file_pos,SEEK_SET); // Seek to the current writing position, this is based on the timestamp and interval
+            preserveForSnapshot(series,file,file_pos,series->header.datasize);
+
             _DEBUG("\t Datapoint Size = %d\n",series->header.datasize);
-            size = fwrite(value,series->header.datasize,1,file); // Write the data point
-            _DEBUG("\t Wrote %d points @ %d\n",size,file_pos);
+            size = file->write(value,series->header.datasize,file_pos); // Write the data point at the current writing position, this is based on the timestamp and interval
+            _DEBUG("\t Wrote %ld bytes @ %ld\n",(long)size,(long)file_pos);
 
-            if(size != 1){ // Check that write completed with the correct number of bytes written
-                fclose(file);
+            if(size != (int64_t)series->header.datasize){ // Check that write completed with the correct number of bytes written
                 _ERROR("\t Failed to direct write data point\n");
                 status = DATA_POINT_WRITE_FAILURE;
                 break;
             }
+            fileRewritten(key,series,file,file_pos,size);
+
             _DEBUG("\t Success\n");
             series->last_write = time(NULL);
         }
 
 
+        latest.update(key,timestamp,value,series->header.datasize);
+        if(feed.active())
+            feed.publish(key,timestamp,value,series->header.datasize);
+
         status = NO_ERROR; // Return successful, don't close file
         break;
 
@@ -430,7 +731,7 @@ retry:
 
 
     if(file != NULL)
-        fclose(file);
+        delete file;
 
     series->access.unlock();
 
@@ -442,6 +743,281 @@ retry:
 }
 
 
+/// Appends n_points points (null fill if data is NULL) to the end of the file, the write ahead cache must be empty
+/// since it maps the points right after the end of the file. series must be locked
+
+bool BSeries::appendPoints(uint32_t key, ENTRY *series, BFile *file, const char *data, int64_t n_points){
+
+    int64_t datasize = series->header.datasize;
+    char *null_fill = NULL;
+
+    for(int64_t done = 0; done < n_points; ){
+        // Null fill goes out one block at a time, data in one write
+        int64_t n = data != NULL ? n_points : (n_points - done < write_ahead_size ? n_points - done : write_ahead_size);
+        const char *chunk = data != NULL ? data : null_fill;
+
+        if(chunk == NULL){
+            if((null_fill = (char*)io->allocBuffer(write_ahead_size * datasize)) == NULL) // Aligned, full blocks go straight out with O_DIRECT
+                return false;
+            memset(null_fill,default_null_fill_byte,write_ahead_size * datasize);
+            chunk = null_fill;
+        }
+
+        int64_t bytes = n * datasize;
+        if(file->write(chunk,bytes,series->file_size) != bytes){
+            _ERROR("\t Failed to append %ld points to series %u\n",(long)n,key);
+            io->freeBuffer(null_fill);
+            return false;
+        }
+        fileAppended(key,series,file,chunk,series->file_size,bytes);
+        series->file_size += bytes;
+
+        done += n;
+    }
+
+    io->freeBuffer(null_fill);
+    return true;
+}
+
+
+
+
+/// Writes n_points consecutive points starting at timestamp in one go, for bulk loads.
+/// Points that are already in the file are overwritten in place, points past the end of the file are appended directly
+/// a block at a time and the last partial block is left in the write ahead cache, where write() would have put it.
+/// A missing series is created with its first point at timestamp and interval seconds between points (0 = default_seconds_per_point).
+/// Returns NO_ERROR, INVALID_DATATYPE if datasize (or a non zero interval) dose not match the series, INVALID_TIME_RANGE if timestamp is before
+/// the first point of the series, or one of the write errors
+
+int BSeries::writeRange(uint32_t key, uint32_t timestamp, const void *values, int64_t n_points, uint32_t datasize, uint32_t interval){
+    return writeRangeNs(key,(int64_t)timestamp * NS_PER_SECOND,values,n_points,datasize,(int64_t)interval * NS_PER_SECOND);
+}
+
+
+/// writeRange() with nanosecond timestamp and interval, a missing series is created with datatype
+
+int BSeries::writeRangeNs(uint32_t key, int64_t timestamp, const void *values, int64_t n_points, uint32_t datasize, int64_t interval, uint32_t datatype){
+
+    if(shuttingDown)
+        return -1;
+
+    if(n_points <= 0)
+        return NO_ERROR;
+
+    index_access.lock();
+    ENTRY *series = &series_list[key];
+    index_access.unlock();
+
+    BFile *file = NULL;
+    int status = NO_ERROR;
+
+    series->access.lock();
+    freezeForSnapshot(key,series);
+
+    do {
+
+        if((status = openSeries(key,series,&file,datasize,timestamp,interval,datatype)) != NO_ERROR)
+            break;
+
+        if(series->header.datasize != datasize || (interval && series->header.interval != interval)){
+            status = INVALID_DATATYPE;
+            break;
+        }
+
+        if(timestamp < series->header.timestamp){
+            status = INVALID_TIME_RANGE;
+            break;
+        }
+
+        if(!validateWriteAheadCache(series)){
+            status = WAL_MEMORY_ALLOCATION_FAILURE;
+            break;
+        }
+
+        if(file == NULL && (file = openFile(key,true)) == NULL){
+            status = INTERNAL_ERROR;
+            break;
+        }
+
+
+        const char *data = (const char*)values;
+        int64_t point = series->points.divide(timestamp - series->header.timestamp);
+        int64_t points_in_file = (series->file_size - series->header_size) / datasize;
+        int64_t done = 0;
+
+        // Sealed part, in place
+        if(point < points_in_file){
+            int64_t n = n_points < points_in_file - point ? n_points : points_in_file - point;
+            int64_t offset = series->header_size + point * datasize;
+
+            preserveForSnapshot(series,file,offset,n * datasize);
+
+            if(file->write(data,n * datasize,offset) != n * datasize){
+                status = DATA_POINT_WRITE_FAILURE;
+                break;
+            }
+            fileRewritten(key,series,file,offset,n * datasize);
+
+            done = n;
+        }
+
+        // Past the end of the file
+        while(done < n_points){
+            points_in_file = (series->file_size - series->header_size) / datasize;
+            int64_t position = point + done - points_in_file; // In the write ahead cache
+            int64_t remaining = n_points - done;
+
+            int64_t limit = flushPoints(series);
+            if(position < limit){
+                int64_t n = remaining < limit - position ? remaining : limit - position;
+                memcpy(series->write_ahead_cache + position * datasize,data + done * datasize,n * datasize);
+                if(position + n > series->cache_points)
+                    series->cache_points = position + n;
+                done += n;
+
+                if(series->cache_points >= limit && !flushBuffer(key,series,file)){
+                    status = WAL_WRITE_FAILURE;
+                    break;
+                }
+                continue;
+            }
+
+            // Starts past the cache, seal the cache then null fill up to the range and append whole blocks
+            if(series->cache_points > 0){
+                if(!flushBuffer(key,series,file)){
+                    status = WAL_WRITE_FAILURE;
+                    break;
+                }
+                continue;
+            }
+
+            int64_t blocks = remaining - remaining % write_ahead_size;
+            if(!appendPoints(key,series,file,NULL,position) || (blocks && !appendPoints(key,series,file,data + done * datasize,blocks))){
+                status = WAL_WRITE_FAILURE;
+                break;
+            }
+            done += blocks;
+        }
+
+        if(status != NO_ERROR)
+            break;
+
+        series->last_write = time(NULL);
+
+        int64_t step = series->header.interval;
+        latest.update(key,timestamp + (n_points - 1) * step,data + (n_points - 1) * datasize,datasize);
+        if(feed.active())
+            feed.publish(key,timestamp,step,data,n_points,datasize);
+
+    } while(false);
+
+
+    if(file != NULL)
+        delete file;
+
+    series->access.unlock();
+
+    return status;
+}
+
+
+
+
+/// Header of a series and the number of points it holds, flushed and cached
+
+int BSeries::readExtent(uint32_t key, SERIES *header, int64_t *n_points){
+
+    index_access.lock();
+    ENTRY *series = &series_list[key];
+    index_access.unlock();
+
+    BFile *file = NULL;
+
+    series->access.lock();
+    int status = loadHeader(key,series,&file);
+    if(status == NO_ERROR){
+        *header = series->header;
+        *n_points = (series->file_size - series->header_size) / series->header.datasize;
+        if(series->write_ahead_cache != NULL)
+            *n_points += series->cache_points;
+    }
+    series->access.unlock();
+
+    if(file)
+        delete file;
+
+    return status;
+}
+
+
+
+
+/// Reads the header of a series from its file unless we already have a valid copy, series must be locked.
+/// The file is only opened when the header has to be read, with a valid header file is left as it was
+
+int BSeries::loadHeader(uint32_t key, ENTRY *series, BFile **file){
+
+    if(series->header.checksum == getChecksum(&series->header))
+        return NO_ERROR;
+
+    _DEBUG("\t INVALID CACHED HEADER, READING HEADER FROM FILE\n");
+
+    if(*file == NULL && (*file = openFile(key,false)) == NULL){
+        _ERROR("\t Failed to open file");
+        return FAILED_TO_OPEN_FILE;
+    }
+
+
+    int status = parseHeader(*file,&series->header,&series->header_size);
+    if(status == NO_ERROR)
+        series->points.set(series->header.interval);
+
+    if(status == FAILED_TO_READ_HEADER){
+        _ERROR("\t FAILED_TO_READ_HEADER\n");
+        return FAILED_TO_READ_HEADER;
+    }
+
+    _DEBUG("%u\n\tVersion: %lu\n\tTimestamp: %lu\n\tInverval: %lu\n\tDatasize: %lu\n\tChecksum: %lu\n\n   ",key,series->header.version,series->header.timestamp,series->header.interval,series->header.datasize,series->header.checksum);
+
+    if(status != NO_ERROR){
+        _ERROR("\t INVALID_HEADER_CHECKSUM\n");
+        return INVALID_HEADER_CHECKSUM;
+    }
+
+    // Get our file size, we get the file size whenver we open a new file, when we update a file we also update the filesize
+    series->file_size = (*file)->size();
+    _DEBUG("\tFile size = %u\n",series->file_size);
+
+    return NO_ERROR;
+}
+
+
+
+/// Copy of the header of a series, loading it from the file if needed
+
+int BSeries::readHeader(uint32_t key, SERIES *header){
+
+    index_access.lock();
+    ENTRY *series = &series_list[key];
+    index_access.unlock();
+
+    BFile *file = NULL;
+
+    series->access.lock();
+    int status = loadHeader(key,series,&file);
+    if(status == NO_ERROR)
+        *header = series->header;
+    series->access.unlock();
+
+    if(file)
+        delete file;
+
+    return status;
+}
+
+
+
+
 /// Read points from a series data file, if the end_time is not specified the current time is used
 /// Returns the number of points read if successful and a result array with the total points requested as if all of the data points were present
 ///
@@ -451,16 +1027,35 @@ retry:
 /// -3 Header Checksum Error
 /// -4 Memory Allocation Failed
 /// -5 Could not open file
+/// -7 Block checksum mismatch (only when verify_on_read is set)
 ///
 ///
 /// NOTE: The returned result array is allocated from the stack and must be freed by the program using the function
 ///
 /// n_points is the number of points in the output array
 /// r_points is the number of real points in the output array (Points found in the time series)
+///
+/// If buffer is given the points are read into it instead of a new array, at most buffer_points are read
 
 
 
-int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n_points, int64_t *real_points, int64_t *seconds_per_point, int64_t *first_point_timestamp, uint32_t *datasize, void** result)
+int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n_points, int64_t *real_points, int64_t *seconds_per_point, int64_t *first_point_timestamp, uint32_t *datasize, void** result, char *buffer, int64_t buffer_points)
+{
+    if(end_time <= 0)
+        end_time = time(NULL);
+
+    int64_t interval = 0;
+    int status = readNs(key,start_time * NS_PER_SECOND,end_time * NS_PER_SECOND,n_points,real_points,&interval,first_point_timestamp,datasize,result,buffer,buffer_points);
+    if(interval)
+        *seconds_per_point = interval / NS_PER_SECOND; // 0 for sub second series, use readNs
+
+    return status;
+}
+
+
+/// read() with nanosecond times, interval is set to the nanoseconds between points
+
+int BSeries::readNs(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n_points, int64_t *real_points, int64_t *interval, int64_t *first_point_timestamp, uint32_t *datasize, void** result, char *buffer, int64_t buffer_points)
 { // Returns number of points if successful or -1 if error
 
 
@@ -471,9 +1066,17 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
 
 
     uint32_t status = NO_ERROR;
-    FILE *file = NULL;
+    BFile *file = NULL;
     ENTRY *series = NULL;
 
+    // File region, read once the series is unlocked
+    char *region_output = NULL;
+    int64_t region_start = 0;
+    int64_t region_points = 0;
+    int64_t region_file_size = 0;
+    int64_t region_header_size = 0;
+    uint32_t region_datasize = 0;
+
 
 
 
@@ -493,15 +1096,8 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
 
         series = &series_list[key];
 
-
-        // Allocate write ahead cache if needed
-        if(!validateWriteAheadCache(series)){
-           _ERROR("\t WAL_MEMORY_ALLOCATION_FAILURE\n");
-           index_access.unlock();
-            status = WAL_MEMORY_ALLOCATION_FAILURE;
-            break;
-        }
-
+        // Reads never need the write ahead cache allocated, it is overlaid only if it exists. (Allocating it here,
+        // before the header is known, sized it for a datasize of 0)
 
         index_access.unlock();
 
@@ -510,7 +1106,7 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
 
 
         if(end_time <= 0)
-            end_time = time(NULL);
+            end_time = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
 
         if(start_time > end_time){
             _ERROR("\t INVALID_TIME_RANGE,  Start time > end time\n");
@@ -530,47 +1126,10 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
 
 
 
-        // Open our file
-
-        file = openFile(key,false);
-        if(file == NULL){
-            _ERROR("\t Failed to open file");
-            status = FAILED_TO_OPEN_FILE;
-            break;
-        }
-
-
-
-
         // Check if our cached header is valid, if not, read it from file
-        if(series->header.checksum != getChecksum(&series->header)){// cached checksum header is invalid, read it from the file
-            _DEBUG("\t INVALID CACHED HEADER, READING HEADER FROM FILE\n");
-
-
-
-            fseek(file,0,SEEK_SET); // Seek begining
-            int size = fread((char*)&series->header,sizeof(series->header),1,file);
-
-            if(size != 1){
-                _ERROR("\t FAILED_TO_READ_HEADER\n");
-                status = FAILED_TO_READ_HEADER;
-                break;
-            }
-
-            _DEBUG("%u\n\tVersion: %lu\n\tTimestamp: %lu\n\tInverval: %lu\n\tDatasize: %lu\n\tChecksum: %lu\n\n   ",key,series->header.version,series->header.timestamp,series->header.interval,series->header.datasize,series->header.checksum);
-
-            if(series->header.checksum != getChecksum(&series->header)){
-                _ERROR("\t INVALID_HEADER_CHECKSUM\n");
-                status = INVALID_HEADER_CHECKSUM;
-                break;
-            }
-
-            // Get our file size, we get the file size whenver we open a new file, when we update a file we also update the filesizeNTRY *
-            fseek(file,0,SEEK_END);
-            series->file_size = ftell(file);
-            _DEBUG("\tFile size = %u\n",series->file_size);
-
-        }
+        status = loadHeader(key,series,&file);
+        if(status != NO_ERROR)
+            break;
 
 
         /// If we reach this point, we have a valid header and our pointer is on the first data point in the series
@@ -579,12 +1138,18 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
         /// Calculate the position in the file (Byte) where we are going to write the data point,
         /// this is based on the start timestampfor the series and the number of seconds between points,
         /// the position is also offseted to account for the header size
-        int64_t points = ( end_time - start_time) / series->header.interval;
-        int64_t points_in_file = (series->file_size - sizeof(SERIES))/series->header.datasize;
-        *seconds_per_point = series->header.interval;
+        int64_t points = series->points.divide(end_time - start_time);
+        int64_t points_in_file = (series->file_size - series->header_size)/series->header.datasize;
+        *interval = series->header.interval;
         // *first_point_timestamp = series->header.timestamp + (series->header.interval * (start_pos + offset));
 
-        char *output = new char[points*series->header.datasize];
+        char *output = buffer;
+        if(buffer != NULL && points > buffer_points){ // Caller supplied buffer, read as much as fits
+            points = buffer_points;
+            end_time = start_time + points * series->header.interval;
+        }
+        if(buffer == NULL)
+            output = new char[points*series->header.datasize];
         if(output == NULL){
             _ERROR("\t MEMORY_ALLOCATION_FAILED\n");
             status = MEMORY_ALLOCATION_FAILED;
@@ -607,22 +1172,26 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
             if(start_time <= series->header.timestamp){ // Have we requested data extending before our first file data point?
                 file_start_point = 0;// ((start_time - series->header.timestamp)/series->header.interval);
             } else {
-                file_start_point = (start_time - series->header.timestamp)/series->header.interval;
+                file_start_point = series->points.divide(start_time - series->header.timestamp);
             }
 
 
 
 
-            file_end_point = (end_time - series->header.timestamp) / series->header.interval;
+            file_end_point = series->points.divide(end_time - series->header.timestamp);
             if(file_end_point > points_in_file){
                 file_end_point = points_in_file;
             }
 
-            buffer_output_points = file_end_point - file_start_point - 1;
-            // THE FILE READ COMMAND WAS COPYING TOO MANY BYTES...
+            buffer_output_points = file_end_point - file_start_point;
 
             int64_t  buffer_output_timestamp = series->header.timestamp + (file_start_point * series->header.interval);
-            buffer_output_pos = (buffer_output_timestamp - start_time) / series->header.interval;
+            buffer_output_pos = series->points.divide(buffer_output_timestamp - start_time);
+
+            // Rounding can map one point past the end of the output buffer, clamp rather than dropping the last point of the file
+            if(buffer_output_pos + buffer_output_points > points){
+                buffer_output_points = points - buffer_output_pos;
+            }
 
 
 
@@ -647,15 +1216,12 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
             _DEBUG("\tbuffer_output_timestamp: %d\n",buffer_output_timestamp);
 
             if(buffer_output_points > 0 && file_start_point >= 0 && file_end_point >= 0){
-
-
-                fseek(file,((file_start_point*series->header.datasize)+sizeof(SERIES)),SEEK_SET); // Read Points
-
-
-                int64_t file_points = fread(output+(buffer_output_pos*series->header.datasize),series->header.datasize,buffer_output_points,file);
-
-             //   int64_t file_points = 0;
-                *real_points += file_points;
+                region_output = output + (buffer_output_pos * series->header.datasize);
+                region_start = file_start_point;
+                region_points = buffer_output_points;
+                region_file_size = series->file_size;
+                region_header_size = series->header_size;
+                region_datasize = series->header.datasize;
             }
 
         }
@@ -684,14 +1250,14 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
             if(start_time <= cache_start_time){ // Have we requested data extending before our first file data point?
                 cache_start_point = 0;
             } else {
-                cache_start_point = ((start_time - cache_start_time)/series->header.interval);
+                cache_start_point = series->points.divide(start_time - cache_start_time);
             }
 
             // cache start point is first point in the cache that we will copy to our buffer
             // if data extends before the cache to include file points this number will always be 0
             // otherwise it will be between 0 to $cache_length
 
-            cache_end_point = (end_time - cache_start_time) / series->header.interval;
+            cache_end_point = series->points.divide(end_time - cache_start_time);
 
             if(cache_end_point < cache_start_point){
                 cache_end_point = cache_start_point;
@@ -708,7 +1274,7 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
             int64_t buffer_output_timestamp = cache_start_time + (cache_start_point * series->header.interval);
             // buffer_output_timestamp is the timestamp that the cache data starts at
 
-            buffer_output_start_pos = (buffer_output_timestamp - start_time) / series->header.interval;
+            buffer_output_start_pos = series->points.divide(buffer_output_timestamp - start_time);
             // buffer output start pos is the position in the output buffer where we will copy our data too
 
             buffer_output_points = cache_end_point - cache_start_point;
@@ -741,7 +1307,7 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
             _DEBUG("\tcache_start_time: %d\n",cache_start_time);
 
             if(buffer_output_points > 0 && series->write_ahead_cache != NULL && cache_start_point >= 0 && cache_end_point >= 0){
-                memcpy(output+(buffer_output_start_pos*series->header.datasize),series->write_ahead_cache + cache_start_point,buffer_output_points*series->header.datasize);
+                memcpy(output+(buffer_output_start_pos*series->header.datasize),series->write_ahead_cache + (cache_start_point*series->header.datasize),buffer_output_points*series->header.datasize);
                 *real_points += buffer_output_points;
             }
 
@@ -758,12 +1324,36 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
     } while (false);
 
 
+    // Only the header, file size and cached points are needed under the lock, the file region is read without it so
+    // writers to this series are not held up by disk reads. The region is below the file size we saw, appends can not
+    // change it. Verification needs the checksum sidecar to be in step with the file so it still reads under the lock
+    bool locked = true;
+    if(status == NO_ERROR && region_points > 0 && !verify_on_read){
+        series->access.unlock();
+        locked = false;
+    }
+
+    if(status == NO_ERROR && region_points > 0){
+        int64_t file_points = readRegion(key,locked ? series : NULL,region_header_size,region_datasize,region_file_size,&file,region_output,region_start,region_points);
+
+        if(file_points < 0){
+            _ERROR("\t Failed to read file region (%d)\n",(int)file_points);
+            if(*result != buffer)
+                delete[] (char*)*result;
+            *result = NULL;
+            status = file_points;
+        } else {
+            *real_points += file_points;
+        }
+    }
+
 
     if(file)
-        fclose(file);
+        delete file;
 
 
-    series->access.unlock();
+    if(locked)
+        series->access.unlock();
 
     return status;
 }
@@ -773,31 +1363,167 @@ int BSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n
 
 
 
-void BSeries::flush()
+/// Queues a read on read_pool, callback is called on a pool thread with the result (result->result must be freed with delete[]).
+/// A read that is cancelled or past its deadline when its turn comes completes with READ_CANCELLED or READ_DEADLINE_EXCEEDED
+/// without touching the disk, one cancelled or expired while it ran completes the same way and its points are freed.
+/// Returns false if the read could not be queued, the callback is not called then
+
+bool BSeries::readCallback(uint32_t key, int64_t start_time, int64_t end_time, function<void(SERIES_RESULT *result)> callback, REQUEST_CONTROL control){
+
+    if(shuttingDown)
+        return false;
+
+    return read_pool.submit([this,key,start_time,end_time,callback,control](){
+
+        SERIES_RESULT r;
+        memset(&r,0,sizeof(r));
+        r.key = key;
+
+        if(control && control->isCancelled()){
+            r.status = READ_CANCELLED;
+        } else if(control && control->expired()){
+            r.status = READ_DEADLINE_EXCEEDED;
+        } else {
+            r.status = read(key,start_time,end_time,&r.n_points,&r.real_points,&r.seconds_per_point,&r.first_point_timestamp,&r.datasize,&r.result);
+
+            if(control && (control->isCancelled() || control->expired())){
+                if(r.status == NO_ERROR)
+                    delete[] (char*)r.result;
+                r.result = NULL;
+                r.status = control->isCancelled() ? READ_CANCELLED : READ_DEADLINE_EXCEEDED;
+            }
+        }
+
+        callback(&r);
+    });
+}
+
+
+/// Same as readCallback with the result delivered through a future, a read that can not be queued completes with status -1
+
+future<SERIES_RESULT> BSeries::readAsync(uint32_t key, int64_t start_time, int64_t end_time, REQUEST_CONTROL control){
+
+    shared_ptr< promise<SERIES_RESULT> > done(new promise<SERIES_RESULT>());
+    future<SERIES_RESULT> result = done->get_future();
+
+    if(!readCallback(key,start_time,end_time,[done](SERIES_RESULT *r){ done->set_value(*r); },control)){
+        SERIES_RESULT r;
+        memset(&r,0,sizeof(r));
+        r.key = key;
+        r.status = -1;
+        done->set_value(r);
+    }
+
+    return result;
+}
+
+
+
+
+/// Latest value of each key, out must have room for n_keys entries, keys without a value get a timestamp of 0.
+/// Returns the number of keys found. Never blocks writers, values come from the in memory latest table
+
+size_t BSeries::readLatest(const uint32_t *keys, size_t n_keys, LATEST *out){
+    return latest.get(keys,n_keys,out);
+}
+
+
+/// Appends the latest value of every key written since start to out
+
+size_t BSeries::readAllLatest(vector<LATEST> *out){
+    return latest.getAll(out);
+}
+
+
+
+
+/// Flushes the write ahead cache of every series
+///
+/// The index lock is only held while the set of series is copied, series are then flushed in parallel
+/// across flush_threads workers and each series lock is only held for its own flush.
+/// progress is called after every series with the number flushed so far, calls are serialized
+
+void BSeries::flush(function<void(size_t flushed, size_t total)> progress)
 {
 
     cout << "Flushing Database" << endl;
 
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
     _DEBUG("Flushing All Series..\n");
+
+    vector< pair<uint32_t,ENTRY*> > pending;
+
+    // Every entry, whether there is anything to write is only known under the series lock
     this->index_access.lock();
-    // Close all open files
-    auto it = series_list.begin();
-    while(it != series_list.end()){
+    for(auto it = series_list.begin(); it != series_list.end(); it++)
+        pending.push_back(make_pair(it->first,&it->second));
+    this->index_access.unlock();
+
+
+    unsigned int threads = flush_threads;
+    if(!threads)
+        threads = thread::hardware_concurrency();
+    if(!threads)
+        threads = 1;
+    if(threads > pending.size())
+        threads = pending.size();
+
+
+    atomic<size_t> next(0);
+    atomic<size_t> flushed(0);
+    atomic<int64_t> bytes(0);
+    mutex progress_access;
+
+    vector<thread> workers;
+    for(unsigned int i = 1; i < threads; i++)
+        workers.push_back(thread(&BSeries::flushWorker,this,&pending,&next,&flushed,&bytes,&progress_access,&progress));
+
+    flushWorker(&pending,&next,&flushed,&bytes,&progress_access,&progress); // This thread is a worker too
+
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+
+    last_flush_bytes = bytes;
+    last_flush_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
 
+    cout << "\t Done Flushing Database, " << pending.size() << " series, " << last_flush_bytes << " bytes in " << last_flush_ms << " ms" << endl;
+}
+
+
+
+void BSeries::flushWorker(vector< pair<uint32_t,ENTRY*> > *pending, atomic<size_t> *next, atomic<size_t> *flushed, atomic<int64_t> *bytes, mutex *progress_access, function<void(size_t, size_t)> *progress){
 
-            it->second.access.lock(); // this will wait for any current writes to complete
+    size_t i;
+    while((i = (*next)++) < pending->size()){
 
-            FILE *file = openFile(it->first,true);
+        uint32_t key = (*pending)[i].first;
+        ENTRY *series = (*pending)[i].second;
+
+        series->access.lock(); // this will wait for any current writes to complete
+
+        bool cached = series->write_ahead_cache != NULL && series->cache_points > 0;
+        if(cached || !series->checksums_stale.empty()){ // Nothing to write otherwise, don't even open the file
+            BFile *file = openFile(key,true);
             if(file != NULL){
-                _DEBUG("Flushing: %u\n",it->first);
-                this->flushBuffer(&it->second,file);
-                fclose(file);
+                _DEBUG("Flushing: %u\n",key);
+                int64_t size = series->cache_points * series->header.datasize;
+                if(cached && this->flushBuffer(key,series,file))
+                    *bytes += size;
+                settleChecksums(key,series,file);
+                delete file;
             }
-            it->second.access.unlock();
-        it++;
+        }
+
+        series->access.unlock();
+
+        size_t done = ++(*flushed);
+        if(*progress){
+            lock_guard<mutex> lock(*progress_access);
+            (*progress)(done,pending->size());
+        }
     }
-    this->index_access.unlock();
-    cout << "\t Done Flushing Database" << endl;
 }
 
 
@@ -809,6 +1535,10 @@ void BSeries::close()
 
     this->shuttingDown = true;
 
+    this->stopScrubber();
+    this->feed.stop();
+    this->read_pool.stop(); // Queued reads complete with -1, we are shutting down
+
     this->flush();
 
 
@@ -820,7 +1550,8 @@ void BSeries::close()
             _DEBUG("Closing: %u\n",it->first);
             it->second.access.lock(); // Ensure nobody is accessing our resource
             if(it->second.write_ahead_cache != NULL){
-                free(it->second.write_ahead_cache);
+                io->freeBuffer(it->second.write_ahead_cache);
+                it->second.write_ahead_cache = NULL;
             }
 
         it++;
@@ -4,14 +4,29 @@
 
 
 #include <map>
+#include <set>
 #include <string.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <vector>
+#include <string>
 #include <iostream>
 
 
 
 #include "debug.h"
+#include "bio.h"
+#include "bcache.h"
+#include "blatest.h"
+#include "bsketch.h"
+#include "bfeed.h"
+#include "bpool.h"
+#include "binterval.h"
 
 
 #define NO_ERROR 0
@@ -28,6 +43,17 @@
 #define INVALID_HEADER_CHECKSUM -3
 #define MEMORY_ALLOCATION_FAILED -4
 #define FAILED_TO_OPEN_FILE -5
+#define BLOCK_CHECKSUM_MISMATCH -7
+
+#define SNAPSHOT_FAILED -8
+#define INVALID_DATATYPE -9
+
+#define READ_CANCELLED -12
+#define READ_DEADLINE_EXCEEDED -13
+
+#define EXPORT_FAILED -14
+
+#define INVALID_AGGREGATE_OP -15
 
 #define TOO_MANY_OPEN_FILES -99
 
@@ -50,29 +76,185 @@ union BType {
 
 
 
-typedef struct _SERIES
+/// Series file header, version 1. Whole second timestamp and interval, still read but no longer written
+
+typedef struct _SERIES_V1
 {
-     uint32_t version; // = 1, version code. only 1 currently valid
+     uint32_t version; // = 1
      uint32_t timestamp; // First point timestamp (Unix Epoch)
      uint32_t interval; // = 10 for every 10 seconds
      uint32_t datasize;
      uint32_t checksum; // = 1234567890 + ((version ^ timestamp) ^ (interval ^ datatype);
+} SERIES_V1;
+
+
+/// Series file header, version 2, and the header of every loaded series in memory.
+/// Times are nanoseconds, version 1 headers are converted when they are loaded and keep version = 1 so
+/// the data is read after the 20 byte header they were written with (ENTRY::header_size)
+
+typedef struct _SERIES
+{
+     uint32_t version; // = 2
+     uint32_t datasize;
+     int64_t timestamp; // First point timestamp, nanoseconds since the Unix Epoch
+     int64_t interval; // nanoseconds between points
+     uint32_t datatype; // DATATYPE_*, the datatype of BType
+     uint32_t checksum; // crc32c of the fields above
 } SERIES;
 
 
+#define SERIES_VERSION 2
+
+/// Version 3 is the version 2 header padded with zeros to SERIES_ALIGNED_DATA_OFFSET, written when the I/O backend
+/// wants aligned writes (BDirectIO) so the data, and with it every full write ahead block, starts on a page boundary
+#define SERIES_VERSION_ALIGNED 3
+#define SERIES_ALIGNED_DATA_OFFSET 4096
+
+#define NS_PER_SECOND 1000000000LL
+
+#define DATATYPE_UNSIGNED 0
+#define DATATYPE_SIGNED 1
+#define DATATYPE_FLOAT 2
+#define DATATYPE_BINARY 3 // opaque values of any datasize
+#define DATATYPE_DEFAULT 0xFF // by datasize, float for 4 bytes, unsigned for 1 byte and binary otherwise
+
+
 typedef struct
 {
      SERIES header;
+     int64_t header_size; // bytes before the first point, sizeof(SERIES), sizeof(SERIES_V1) or SERIES_ALIGNED_DATA_OFFSET
+     BInterval points; // point offsets, points.divide(time - header.timestamp)
      mutex access;
      int64_t file_size;
      uint32_t last_write;
      uint32_t last_commit;
      uint32_t cache_start_timestamp;
      char* write_ahead_cache;
+     int64_t cache_points; // populated prefix of the write ahead cache, highest written point + 1
+     bool checksums_checked; // sidecar checked against the file since the header was loaded
+     set<int64_t> checksums_stale; // blocks rewritten in place whose crc is not recomputed yet
+     int64_t snapshot_size; // file size frozen by a running snapshot
+     vector< pair<int64_t,string> > *snapshot_undo; // original bytes of direct writes below snapshot_size, NULL when no snapshot is running
+     uint64_t snapshot_epoch; // last snapshot epoch this series was frozen for
+     int64_t sketch_invalidated; // block + 1 of the last stale sketch record written, 0 = none
+     uint64_t sketch_generation; // bumped by every direct write into sketched data
+     vector< pair<int64_t,uint32_t> > sketch_index; // (sidecar offset, bytes) of the latest sketch of each block, offset 0 = none
+     int64_t sketch_indexed; // sidecar bytes scanned into sketch_index
+     int64_t sketch_records; // records in the scanned part
+     int64_t sketch_blocks; // blocks with a record in the scanned part
 } ENTRY;
 
 
 
+/// Result of a single key in a multi key or async read, fields match the output
+/// parameters of BSeries::read
+
+typedef struct
+{
+     uint32_t key;
+     int status;
+     int64_t n_points;
+     int64_t real_points;
+     int64_t seconds_per_point;
+     int64_t first_point_timestamp;
+     uint32_t datasize;
+     void *result; // must be freed with delete[] by the caller
+} SERIES_RESULT;
+
+
+
+/// Bulk export formats, see exportData
+
+#define EXPORT_CSV 0
+#define EXPORT_ARROW 1
+
+
+/// Cross series aggregation operators, see readGroupAggregate
+
+#define AGGREGATE_SUM 0
+#define AGGREGATE_AVG 1
+#define AGGREGATE_MIN 2
+#define AGGREGATE_MAX 3
+#define AGGREGATE_COUNT 4
+
+typedef struct
+{
+     double sum;
+     uint64_t count;
+     double min;
+     double max;
+} AGGREGATE_BUCKET;
+
+
+/// One readGroupAggregate call, shared with its workers on read_pool.
+/// Workers that only start after the caller closed the job return without touching it
+
+typedef struct
+{
+     const uint32_t *keys;
+     size_t n_keys;
+     int64_t start_time;
+     int64_t end_time;
+     int64_t bucket_seconds;
+     atomic<size_t> next;
+     atomic<size_t> failed;
+     vector<AGGREGATE_BUCKET> total;
+     mutex access;
+     condition_variable finished;
+     int running;
+     bool closed;
+} AGGREGATE_JOB;
+
+
+/// One readQuantiles call, shared with its workers on read_pool like AGGREGATE_JOB
+
+typedef struct
+{
+     const uint32_t *keys;
+     size_t n_keys;
+     int64_t start_time;
+     int64_t end_time;
+     bool exact;
+     atomic<size_t> next;
+     atomic<size_t> failed;
+     BQuantileSketch total;
+     vector<float> exact_values;
+     mutex access;
+     condition_variable finished;
+     int running;
+     bool closed;
+} QUANTILE_JOB;
+
+
+/// One series as frozen by a snapshot, see bsnapshot.cpp
+
+typedef struct
+{
+     uint32_t key;
+     ENTRY *series;
+     int64_t size; // sealed file size, -1 if there is no file
+     char *cache;
+     int64_t cache_bytes;
+     vector< pair<int64_t,string> > *undo;
+} FROZEN_SERIES;
+
+
+
+/// Block checksum sidecar (<key>.crc), a header followed by one crc32c per block.
+/// Blocks are block_bytes (write_ahead_size * datasize) of data starting after the series header,
+/// the last block may be partial and its crc covers only the bytes present
+
+#define CHECKSUM_MAGIC 0x43524342 // "BCRC"
+#define CHECKSUM_MAX_STALE 64 // rewritten blocks a series collects before their crcs are recomputed
+
+typedef struct
+{
+     uint32_t magic;
+     uint32_t block_bytes;
+} CHECKSUM_HEADER;
+
+
+
 
 
 //#define WRITE_AHEAD_SIZE 4096
@@ -87,26 +269,55 @@ class BSeries
 public:
     BSeries();
 
-    FILE* openFile(uint64_t key, bool writeMode);
-    bool flushBuffer(ENTRY *entry, FILE *file);
+    BFile* openFile(uint64_t key, bool writeMode);
+    bool flushBuffer(uint32_t key, ENTRY *entry, BFile *file);
+    int64_t flushPoints(ENTRY *series);
 
 
-    int createSeries(FILE *file, SERIES *series, uint32_t datasize);
+    int createSeries(BFile *file, ENTRY *series, uint32_t datasize, int64_t timestamp = 0, int64_t interval = 0, uint32_t datatype = DATATYPE_DEFAULT);
+    int defineSeries(uint32_t key, uint32_t datatype, uint32_t datasize, int64_t interval, int64_t timestamp = 0);
+    int parseHeader(BFile *file, SERIES *header, int64_t *header_size);
     uint32_t getChecksum(SERIES *series);
+    uint32_t getChecksum(SERIES_V1 *series);
 
+    // Seconds, timestamps and intervals of the *Ns functions are nanoseconds
     int write(uint32_t key, void *value, uint32_t datasize, uint32_t timestamp = 0);
-    int read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n_points, int64_t *r_points, int64_t *seconds_per_point, int64_t *first_point_timestamp, uint32_t *datasize, void **result);
+    int writeNs(uint32_t key, void *value, uint32_t datasize, int64_t timestamp = 0);
+    int writeRange(uint32_t key, uint32_t timestamp, const void *values, int64_t n_points, uint32_t datasize, uint32_t interval = 0);
+    int writeRangeNs(uint32_t key, int64_t timestamp, const void *values, int64_t n_points, uint32_t datasize, int64_t interval = 0, uint32_t datatype = DATATYPE_DEFAULT);
+    bool appendPoints(uint32_t key, ENTRY *series, BFile *file, const char *data, int64_t n_points);
+    int read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n_points, int64_t *r_points, int64_t *seconds_per_point, int64_t *first_point_timestamp, uint32_t *datasize, void **result, char *buffer = NULL, int64_t buffer_points = 0);
+    int readNs(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n_points, int64_t *r_points, int64_t *interval, int64_t *first_point_timestamp, uint32_t *datasize, void **result, char *buffer = NULL, int64_t buffer_points = 0);
+
+    // Non blocking reads, run read() on read_pool
+    future<SERIES_RESULT> readAsync(uint32_t key, int64_t start_time, int64_t end_time, REQUEST_CONTROL control = nullptr);
+    bool readCallback(uint32_t key, int64_t start_time, int64_t end_time, function<void(SERIES_RESULT *result)> callback, REQUEST_CONTROL control = nullptr);
+
+    BIOPool read_pool; // read_pool.setThreads(n) before the first async read
+
+    int loadHeader(uint32_t key, ENTRY *series, BFile **file);
+    int openSeries(uint32_t key, ENTRY *series, BFile **file, uint32_t datasize, int64_t timestamp = 0, int64_t interval = 0, uint32_t datatype = DATATYPE_DEFAULT);
+    int readHeader(uint32_t key, SERIES *header);
+    int readExtent(uint32_t key, SERIES *header, int64_t *n_points);
 
     map<uint32_t,ENTRY> series_list;
     const char *data_directory;
 
+    BIOBackend *io; // set before the first read or write, defaults to default_io
+    BPosixIO default_io;
+
     int write_ahead_size;
     int default_seconds_per_point;
     char default_null_fill_byte;
 
-    void flush();
+    void flush(function<void(size_t flushed, size_t total)> progress = nullptr);
+    void flushWorker(vector< pair<uint32_t,ENTRY*> > *pending, atomic<size_t> *next, atomic<size_t> *flushed, atomic<int64_t> *bytes, mutex *progress_access, function<void(size_t, size_t)> *progress);
     void close();
 
+    unsigned int flush_threads; // 0 = one per core
+    int64_t last_flush_ms;
+    int64_t last_flush_bytes;
+
     void closeSeries(uint32_t max_age);
     bool trim();
 
@@ -118,6 +329,106 @@ public:
 
     ~BSeries();
     bool validateWriteAheadCache(ENTRY *series);
+
+
+    // Called whenever data in a file changes, keeps checksums and the read cache in step
+    void fileAppended(uint32_t key, ENTRY *series, BFile *file, const char *data, int64_t offset, int64_t bytes);
+    void fileRewritten(uint32_t key, ENTRY *series, BFile *file, int64_t offset, int64_t bytes);
+
+    int64_t readRegion(uint32_t key, ENTRY *series, int64_t header_size, uint32_t datasize, int64_t file_size, BFile **file, char *output, int64_t first_point, int64_t n_points);
+
+    BReadCache read_cache; // opt in, read_cache.setCapacity(bytes)
+
+
+    // Latest value of every series written since start, lock free
+    size_t readLatest(const uint32_t *keys, size_t n_keys, LATEST *out);
+    size_t readAllLatest(vector<LATEST> *out);
+
+    BLatest latest;
+
+    BFeed feed; // change feed of every successful write, feed.subscribe(...)
+
+
+    // Cross series aggregation, see baggregate.cpp
+    int readGroupAggregate(const uint32_t *keys, size_t n_keys, int64_t start_time, int64_t end_time, int64_t bucket_seconds, int op, double **result, int64_t *n_buckets, size_t *skipped = NULL, unsigned int threads = 0);
+    int aggregateSeries(uint32_t key, int64_t start_time, int64_t end_time, int64_t bucket_seconds, char *buffer, vector<AGGREGATE_BUCKET> *buckets);
+    void aggregateWorker(AGGREGATE_JOB *job);
+
+
+    // Quantile sketches of float series, see bquantile.cpp
+    int readQuantiles(const uint32_t *keys, size_t n_keys, int64_t start_time, int64_t end_time, const double *q, size_t n_q, double *out, size_t *skipped = NULL, bool exact = false, unsigned int threads = 0);
+    int quantileSeries(uint32_t key, int64_t start_time, int64_t end_time, BQuantileSketch *sketch, vector<float> *exact_values, char *buffer);
+    void quantileWorker(QUANTILE_JOB *job);
+
+    bool block_sketches; // maintain the <key>.qsk sidecar for float series
+    double sketch_accuracy; // relative error of readQuantiles, changing it rebuilds the sidecars
+
+    void appendSketches(uint32_t key, ENTRY *series, BFile *file, const char *data, int64_t offset, int64_t bytes);
+    void invalidateSketches(uint32_t key, ENTRY *series, int64_t offset, int64_t bytes);
+
+    BFile* openSketchFile(uint32_t key, bool writeMode);
+    BFile* openSketchesForAppend(uint32_t key, ENTRY *series);
+    bool loadSketches(uint32_t key, ENTRY *series, int64_t first_block, int64_t end_block, map<int64_t,string> *sketches);
+    bool rebuildSketches(uint32_t key, BFile **file, int64_t header_size, const vector<int64_t> &blocks, map<int64_t,string> *sketches);
+    bool storeSketches(uint32_t key, ENTRY *series, const map<int64_t,string> &sketches);
+
+
+    // Block checksums, see bchecksum.cpp
+    bool block_checksums; // maintain the <key>.crc sidecar on every append and direct write, off by default
+    bool verify_on_read; // verify every block a read touches (needs block_checksums), reads fail with BLOCK_CHECKSUM_MISMATCH
+
+    void appendChecksums(uint32_t key, ENTRY *series, BFile *file, const char *data, int64_t offset, int64_t bytes);
+    void rewriteChecksums(uint32_t key, ENTRY *series, BFile *file, int64_t offset, int64_t bytes);
+    void settleChecksums(uint32_t key, ENTRY *series, BFile *file);
+
+    BFile* openChecksumFile(uint32_t key, bool writeMode);
+    BFile* openVerifiedChecksums(uint32_t key, ENTRY *series, BFile *file);
+    bool validateChecksums(uint32_t key, ENTRY *series, BFile *file, int64_t data_bytes);
+    bool rebuildChecksums(uint32_t key, ENTRY *series, BFile *file, int64_t data_bytes);
+    int checkBlock(BFile *file, BFile *checksums, int64_t header_size, uint32_t datasize, int64_t data_bytes, int64_t block, char *buffer, int64_t *block_bytes);
+
+    atomic<uint64_t> checksum_errors;
+
+
+    // Hot snapshots, see bsnapshot.cpp
+    int snapshot(const char *target_directory);
+    void preserveForSnapshot(ENTRY *series, BFile *file, int64_t offset, int64_t bytes);
+    void freezeForSnapshot(uint32_t key, ENTRY *series);
+
+    mutex snapshot_access; // one snapshot at a time
+    atomic<uint64_t> snapshot_epoch; // bumped under index_access by every snapshot, the point in time it copies
+    mutex snapshot_frozen_access;
+    bool snapshot_active; // series frozen while set go to snapshot_frozen
+    vector<FROZEN_SERIES> snapshot_frozen;
+
+
+    // Bulk export / import, see bexport.cpp
+    int exportData(const char *target_directory, int format = EXPORT_ARROW, unsigned int threads = 0, function<void(size_t exported, size_t total)> progress = nullptr);
+    int importData(const char *source_directory, unsigned int threads = 0, function<void(size_t imported, size_t total)> progress = nullptr);
+    int exportSeries(uint32_t key, const char *target_directory, int format, char *buffer, int64_t *exported);
+    int importFile(const char *filename, int64_t *imported);
+    void exportWorker(const vector<uint32_t> *keys, const char *target_directory, int format, char *buffer, atomic<size_t> *next, FILE *manifest, mutex *manifest_access, atomic<size_t> *done, atomic<size_t> *failed, atomic<int64_t> *points, function<void(size_t, size_t)> *progress);
+    void importWorker(const vector<string> *files, atomic<size_t> *next, atomic<size_t> *done, atomic<size_t> *failed, atomic<int64_t> *points, mutex *progress_access, function<void(size_t, size_t)> *progress);
+
+
+    // Background scrubber, verifies every block of every series at no more than bytes_per_second
+    void startScrubber(uint64_t bytes_per_second, uint32_t pass_interval = 3600);
+    void stopScrubber();
+    void scrubLoop();
+    bool scrubSeries(uint32_t key);
+    bool scrubWait(int64_t milliseconds);
+
+    thread scrubber;
+    mutex scrub_access;
+    condition_variable scrub_signal;
+    bool scrubbing;
+    uint64_t scrub_rate;
+    uint32_t scrub_interval;
+    int64_t scrub_bytes; // bytes verified in the current pass, used for throttling
+    chrono::steady_clock::time_point scrub_started;
+
+    atomic<uint64_t> scrub_blocks;
+    atomic<uint64_t> scrub_passes;
 };
 
 #endif // BSERIES_H
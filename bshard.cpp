@@ -0,0 +1,562 @@
+#include "bshard.h"
+#include "debug.h"
+
+#include <future>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+
+
+BShardedSeries::BShardedSeries(unsigned int shards)
+{
+
+    if(!shards)
+        shards = thread::hardware_concurrency();
+    if(!shards)
+        shards = 1;
+
+    for(unsigned int i = 0; i < shards; i++){
+        SHARD *shard = new SHARD();
+        shard->db = new BSeries();
+        shard->core = -1;
+        shard->running = false;
+        shard->writes = 0;
+        shard->write_errors = 0;
+        this->shards.push_back(shard);
+    }
+
+    this->data_directory = NULL;
+    this->default_seconds_per_point = 10;
+    this->default_null_fill_byte = 0xFF;
+    this->write_ahead_size = 4096;
+
+    this->pin_threads = true;
+    this->max_queue_length = 0;
+    this->latest_capacity = 1 << 18;
+    this->feed_capacity = 1 << 18;
+    this->next_feed_id = 0;
+
+    this->shuttingDown = false;
+    this->started = false;
+
+}
+
+
+
+/// Applies our settings to every shard and starts the shard threads, settings must not be changed once started
+
+bool BShardedSeries::start(){
+
+    if(started || data_directory == NULL)
+        return false;
+
+    unsigned int cores = thread::hardware_concurrency();
+
+    for(size_t i = 0; i < shards.size(); i++){
+        SHARD *shard = shards[i];
+
+        shard->db->data_directory = data_directory;
+        shard->db->write_ahead_size = write_ahead_size;
+        shard->db->default_seconds_per_point = default_seconds_per_point;
+        shard->db->default_null_fill_byte = default_null_fill_byte;
+        shard->db->flush_threads = 1; // Shards already flush in parallel
+        shard->db->latest.setCapacity(latest_capacity / shards.size());
+        shard->db->feed.setCapacity(feed_capacity / shards.size());
+
+        shard->running = true;
+        shard->worker = thread(&BShardedSeries::shardLoop,this,shard);
+
+#ifdef __linux__
+        if(pin_threads && cores){
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(i % cores,&cpuset);
+            if(pthread_setaffinity_np(shard->worker.native_handle(),sizeof(cpu_set_t),&cpuset) == 0){
+                shard->core = i % cores;
+            } else {
+                _WARN("Failed to pin shard %u to core %u\n",(uint32_t)i,(uint32_t)(i % cores));
+            }
+        }
+#endif
+    }
+
+    started = true;
+    return true;
+}
+
+
+
+
+unsigned int BShardedSeries::shardFor(uint32_t key){
+    // murmur3 fmix32 mixes every key bit into every hash bit, so keys allocated with a stride still spread evenly,
+    // the high bits then pick the shard (multiply and shift instead of a modulo)
+    uint32_t hash = key;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return (uint32_t)(((uint64_t)hash * shards.size()) >> 32);
+}
+
+
+unsigned int BShardedSeries::shardCount(){
+    return shards.size();
+}
+
+
+uint64_t BShardedSeries::writeErrors(){
+    uint64_t errors = 0;
+    for(size_t i = 0; i < shards.size(); i++)
+        errors += shards[i]->write_errors;
+    return errors;
+}
+
+
+
+
+/// Queues message on shard, past max_queue_length only messages that are not bounded get in
+
+int BShardedSeries::post(SHARD *shard, SHARD_MESSAGE &message, bool bounded){
+
+    unique_lock<mutex> lock(shard->queue_access);
+
+    if(!shard->running)
+        return SHARD_NOT_RUNNING;
+
+    if(bounded && max_queue_length && shard->queue.size() >= max_queue_length)
+        return SHARD_QUEUE_FULL;
+
+    bool wake = shard->queue.empty();
+    shard->queue.push_back(std::move(message));
+    lock.unlock();
+
+    if(wake)
+        shard->queue_signal.notify_one();
+
+    return NO_ERROR;
+}
+
+
+
+/// Runs a task on the shard thread and waits for it to complete, returns NO_ERROR or why it could not be queued
+
+int BShardedSeries::runTask(SHARD *shard, function<void(BSeries*)> task, bool bounded){
+
+    promise<void> done;
+    future<void> finished = done.get_future();
+
+    SHARD_MESSAGE message;
+    message.task = [&task,&done](BSeries *db){
+        task(db);
+        done.set_value();
+    };
+
+    int status = post(shard,message,bounded);
+    if(status != NO_ERROR)
+        return status;
+
+    finished.wait();
+    return NO_ERROR;
+}
+
+
+
+
+/// Shard thread, drains the whole queue at once so the queue lock is only taken once per batch
+
+void BShardedSeries::shardLoop(SHARD *shard){
+
+    deque<SHARD_MESSAGE> batch;
+
+    while(true){
+
+        {
+            unique_lock<mutex> lock(shard->queue_access);
+            while(shard->running && shard->queue.empty())
+                shard->queue_signal.wait(lock);
+
+            if(shard->queue.empty()) // Stopped and nothing left to do
+                break;
+
+            batch.swap(shard->queue);
+        }
+
+        for(size_t i = 0; i < batch.size(); i++){
+            SHARD_MESSAGE &message = batch[i];
+
+            if(message.task){
+                message.task(shard->db);
+                continue;
+            }
+
+            if(shard->db->writeNs(message.key,message.value,message.datasize,message.timestamp) != NO_ERROR)
+                shard->write_errors++;
+            shard->writes++;
+        }
+
+        batch.clear();
+    }
+}
+
+
+
+
+/// Creates a series on the owning shard and waits for it, see BSeries::defineSeries
+
+int BShardedSeries::defineSeries(uint32_t key, uint32_t datatype, uint32_t datasize, int64_t interval, int64_t timestamp){
+
+    if(shuttingDown || !started)
+        return -1;
+
+    int status = INTERNAL_ERROR;
+
+    int queued = runTask(shards[shardFor(key)],[&](BSeries *db){
+        status = db->defineSeries(key,datatype,datasize,interval,timestamp);
+    });
+
+    return queued != NO_ERROR ? queued : status;
+}
+
+
+
+
+/// Queues a write on the owning shard, returns as soon as the write is queued.
+/// Failed writes are counted per shard, see writeErrors()
+
+int BShardedSeries::write(uint32_t key, void *value, uint32_t datasize, uint32_t timestamp){
+
+    if(!timestamp) // Stamp at submission, the shard may get to it later
+        timestamp = time(NULL);
+
+    return writeNs(key,value,datasize,(int64_t)timestamp * NS_PER_SECOND);
+}
+
+
+/// write() with a nanosecond timestamp, 0 = now
+
+int BShardedSeries::writeNs(uint32_t key, void *value, uint32_t datasize, int64_t timestamp){
+
+    if(shuttingDown || !started)
+        return -1;
+
+    if(!timestamp)
+        timestamp = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+
+    SHARD_MESSAGE message;
+    message.key = key;
+    message.timestamp = timestamp;
+    message.datasize = datasize;
+
+    if(datasize <= sizeof(message.value)){
+        memcpy(message.value,value,datasize);
+    } else {
+        string copy((char*)value,datasize);
+        SHARD *shard = shards[shardFor(key)];
+        message.task = [copy,key,datasize,timestamp,shard](BSeries *db){
+            if(db->writeNs(key,(void*)copy.data(),datasize,timestamp) != NO_ERROR)
+                shard->write_errors++;
+            shard->writes++;
+        };
+    }
+
+    return post(shards[shardFor(key)],message);
+}
+
+
+
+
+/// Range writes run on the owning shard and wait for it, so the caller gets the status of the write itself
+
+int BShardedSeries::writeRange(uint32_t key, uint32_t timestamp, const void *values, int64_t n_points, uint32_t datasize, uint32_t interval){
+    return writeRangeNs(key,(int64_t)timestamp * NS_PER_SECOND,values,n_points,datasize,(int64_t)interval * NS_PER_SECOND);
+}
+
+
+int BShardedSeries::writeRangeNs(uint32_t key, int64_t timestamp, const void *values, int64_t n_points, uint32_t datasize, int64_t interval, uint32_t datatype){
+
+    if(shuttingDown || !started)
+        return -1;
+
+    int status = INTERNAL_ERROR;
+
+    int queued = runTask(shards[shardFor(key)],[&](BSeries *db){
+        status = db->writeRangeNs(key,timestamp,values,n_points,datasize,interval,datatype);
+    });
+
+    return queued != NO_ERROR ? queued : status;
+}
+
+
+
+
+int BShardedSeries::read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n_points, int64_t *r_points, int64_t *seconds_per_point, int64_t *first_point_timestamp, uint32_t *datasize, void **result){
+
+    if(shuttingDown || !started)
+        return -1;
+
+    int status = INTERNAL_ERROR;
+
+    int queued = runTask(shards[shardFor(key)],[&](BSeries *db){
+        status = db->read(key,start_time,end_time,n_points,r_points,seconds_per_point,first_point_timestamp,datasize,result);
+    });
+
+    return queued != NO_ERROR ? queued : status;
+}
+
+
+/// read() with nanosecond times, see BSeries::readNs
+
+int BShardedSeries::readNs(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n_points, int64_t *r_points, int64_t *interval, int64_t *first_point_timestamp, uint32_t *datasize, void **result){
+
+    if(shuttingDown || !started)
+        return -1;
+
+    int status = INTERNAL_ERROR;
+
+    int queued = runTask(shards[shardFor(key)],[&](BSeries *db){
+        status = db->readNs(key,start_time,end_time,n_points,r_points,interval,first_point_timestamp,datasize,result);
+    });
+
+    return queued != NO_ERROR ? queued : status;
+}
+
+
+
+
+/// Reads many keys at once, keys are grouped by shard and every shard reads its keys in parallel.
+/// results must have room for n_keys entries and is filled in the same order as keys,
+/// returns the number of keys that were read successfully
+
+int BShardedSeries::readMulti(const uint32_t *keys, size_t n_keys, int64_t start_time, int64_t end_time, SERIES_RESULT *results){
+
+    if(shuttingDown || !started)
+        return -1;
+
+    vector< vector<size_t> > owned(shards.size());
+
+    for(size_t i = 0; i < n_keys; i++){
+        memset(&results[i],0,sizeof(SERIES_RESULT));
+        results[i].key = keys[i];
+        results[i].status = SHARD_NOT_RUNNING;
+        owned[shardFor(keys[i])].push_back(i);
+    }
+
+
+    vector< promise<void> > done(shards.size());
+    vector< future<void> > finished;
+
+    for(size_t s = 0; s < shards.size(); s++){
+
+        finished.push_back(done[s].get_future());
+
+        if(owned[s].empty()){
+            done[s].set_value();
+            continue;
+        }
+
+        vector<size_t> *indexes = &owned[s];
+        promise<void> *signal = &done[s];
+
+        SHARD_MESSAGE message;
+        message.task = [indexes,signal,results,start_time,end_time](BSeries *db){
+            for(size_t i = 0; i < indexes->size(); i++){
+                SERIES_RESULT *r = &results[(*indexes)[i]];
+                r->status = db->read(r->key,start_time,end_time,&r->n_points,&r->real_points,&r->seconds_per_point,&r->first_point_timestamp,&r->datasize,&r->result);
+            }
+            signal->set_value();
+        };
+
+        int queued = post(shards[s],message);
+        if(queued != NO_ERROR){
+            for(size_t i = 0; i < owned[s].size(); i++)
+                results[owned[s][i]].status = queued;
+            done[s].set_value();
+        }
+    }
+
+
+    int success = 0;
+    for(size_t s = 0; s < finished.size(); s++)
+        finished[s].wait();
+
+    for(size_t i = 0; i < n_keys; i++){
+        if(results[i].status == NO_ERROR)
+            success++;
+    }
+
+    return success;
+}
+
+
+
+
+/// The latest value tables are lock free, they are read directly instead of going through the shard queues
+
+size_t BShardedSeries::readLatest(const uint32_t *keys, size_t n_keys, LATEST *out){
+
+    size_t found = 0;
+    for(size_t i = 0; i < n_keys; i++){
+        if(shards[shardFor(keys[i])]->db->latest.get(keys[i],&out[i]))
+            found++;
+    }
+    return found;
+}
+
+
+size_t BShardedSeries::readAllLatest(vector<LATEST> *out){
+
+    size_t found = 0;
+    for(size_t i = 0; i < shards.size(); i++)
+        found += shards[i]->db->latest.getAll(out);
+    return found;
+}
+
+
+
+
+/// Subscribes to the change feed of every shard owning one of keys (every shard if keys is NULL).
+/// Each shard delivers its own batches from its own dispatcher thread, callback must be thread safe.
+/// Returns the subscription id
+
+int BShardedSeries::subscribe(const uint32_t *keys, size_t n_keys, SHARD_FEED_CALLBACK callback, const uint64_t *from_sequences){
+
+    vector< vector<uint32_t> > owned(shards.size());
+    if(keys != NULL){
+        for(size_t i = 0; i < n_keys; i++)
+            owned[shardFor(keys[i])].push_back(keys[i]);
+    }
+
+    vector<int> ids(shards.size(),-1);
+
+    for(size_t s = 0; s < shards.size(); s++){
+        if(keys != NULL && owned[s].empty())
+            continue;
+
+        unsigned int shard = s;
+        ids[s] = shards[s]->db->feed.subscribe(keys != NULL ? owned[s].data() : NULL,owned[s].size(),
+                [callback,shard](const FEED_EVENT *events, size_t n_events, uint64_t missed){
+                    callback(shard,events,n_events,missed);
+                },
+                from_sequences != NULL ? from_sequences[s] : FEED_FROM_NOW);
+    }
+
+    lock_guard<mutex> lock(feed_access);
+    int id = next_feed_id++;
+    feed_subscriptions[id] = ids;
+    return id;
+}
+
+
+void BShardedSeries::unsubscribe(int id){
+
+    vector<int> ids;
+    {
+        lock_guard<mutex> lock(feed_access);
+        auto found = feed_subscriptions.find(id);
+        if(found == feed_subscriptions.end())
+            return;
+        ids = found->second;
+        feed_subscriptions.erase(found);
+    }
+
+    for(size_t s = 0; s < ids.size(); s++){
+        if(ids[s] >= 0)
+            shards[s]->db->feed.unsubscribe(ids[s]);
+    }
+}
+
+
+/// Events not yet delivered to the subscription, summed over shards
+
+uint64_t BShardedSeries::lag(int id){
+
+    lock_guard<mutex> lock(feed_access);
+
+    auto found = feed_subscriptions.find(id);
+    if(found == feed_subscriptions.end())
+        return 0;
+
+    uint64_t behind = 0;
+    for(size_t s = 0; s < found->second.size(); s++){
+        if(found->second[s] >= 0)
+            behind += shards[s]->db->feed.lag(found->second[s]);
+    }
+    return behind;
+}
+
+
+
+
+/// Every shard flushes its own series, shards flush in parallel.
+/// Flushes are queued past max_queue_length, they only make the shard catch up
+
+void BShardedSeries::flush(){
+
+    if(!started)
+        return;
+
+    vector<thread> flushing;
+    for(size_t i = 0; i < shards.size(); i++){
+        SHARD *shard = shards[i];
+        flushing.push_back(thread([this,shard](){
+            runTask(shard,[](BSeries *db){ db->flush(); },false);
+        }));
+    }
+
+    for(size_t i = 0; i < flushing.size(); i++)
+        flushing[i].join();
+}
+
+
+
+
+void BShardedSeries::close(){
+
+    cout << "Closing Sharded Database" << endl;
+
+    this->shuttingDown = true;
+
+    // Stop accepting messages, shard threads finish whatever is queued then exit
+    for(size_t i = 0; i < shards.size(); i++){
+        SHARD *shard = shards[i];
+        {
+            lock_guard<mutex> lock(shard->queue_access);
+            shard->running = false;
+        }
+        shard->queue_signal.notify_one();
+    }
+
+    for(size_t i = 0; i < shards.size(); i++){
+        if(shards[i]->worker.joinable())
+            shards[i]->worker.join();
+    }
+
+    // Shard threads are gone, close from here
+    for(size_t i = 0; i < shards.size(); i++){
+        if(!shards[i]->db->shuttingDown)
+            shards[i]->db->close();
+    }
+
+    cout << "\t Done Closing Sharded Database" << endl;
+}
+
+
+
+
+BShardedSeries::~BShardedSeries()
+{
+    if(!this->shuttingDown){
+        _ERROR("CRITICAL!! INVALID USAGE! BSHARDEDSERIES SHOULD BE CLOSED BEFORE BEING DECONSTRUCTED!");
+        this->close();
+    }
+
+    for(size_t i = 0; i < shards.size(); i++){
+        delete shards[i]->db;
+        delete shards[i];
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef BSHARD_H
+#define BSHARD_H
+
+
+
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+#include "bseries.h"
+
+
+
+#define SHARD_QUEUE_FULL -10
+#define SHARD_NOT_RUNNING -11
+
+
+
+/// A single request routed to a shard, writes are carried by value so the
+/// hot path dose not allocate, everything else is carried as a task which
+/// is executed on the shard thread against the shards own BSeries
+
+typedef struct
+{
+     uint32_t key;
+     int64_t timestamp; // nanoseconds
+     uint32_t datasize;
+     char value[8];
+     function<void(BSeries*)> task; // empty for plain writes
+} SHARD_MESSAGE;
+
+
+/// Change feed callback of a sharded database, sequences are per shard so resuming needs the shard and its sequence
+
+typedef function<void(unsigned int shard, const FEED_EVENT *events, size_t n_events, uint64_t missed)> SHARD_FEED_CALLBACK;
+
+
+typedef struct
+{
+     BSeries *db;
+     thread worker;
+     int core; // -1 = not pinned
+
+     mutex queue_access;
+     condition_variable queue_signal;
+     deque<SHARD_MESSAGE> queue;
+     bool running;
+
+     atomic<uint64_t> writes;
+     atomic<uint64_t> write_errors;
+} SHARD;
+
+
+/// Shared nothing engine mode
+///
+/// The key space is partitioned across n shards, each shard is a complete BSeries (index, write ahead caches, files)
+/// which is only ever touched by its own thread, the thread is optionally pinned to a core.
+/// Callers never touch a shard directly, requests are routed to the owning shard as messages
+/// so ENTRY cache lines and write ahead buffers stay on a single core.
+///
+/// Shards share the data directory, the file layout is unchanged so the shard count can change between runs.
+
+class BShardedSeries
+{
+public:
+    BShardedSeries(unsigned int shards = 0); // 0 = one shard per core
+
+    bool start();
+
+    int defineSeries(uint32_t key, uint32_t datatype, uint32_t datasize, int64_t interval, int64_t timestamp = 0);
+
+    int write(uint32_t key, void *value, uint32_t datasize, uint32_t timestamp = 0);
+    int writeNs(uint32_t key, void *value, uint32_t datasize, int64_t timestamp = 0);
+    int writeRange(uint32_t key, uint32_t timestamp, const void *values, int64_t n_points, uint32_t datasize, uint32_t interval = 0);
+    int writeRangeNs(uint32_t key, int64_t timestamp, const void *values, int64_t n_points, uint32_t datasize, int64_t interval = 0, uint32_t datatype = DATATYPE_DEFAULT);
+
+    int read(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n_points, int64_t *r_points, int64_t *seconds_per_point, int64_t *first_point_timestamp, uint32_t *datasize, void **result);
+    int readNs(uint32_t key, int64_t start_time, int64_t end_time, int64_t *n_points, int64_t *r_points, int64_t *interval, int64_t *first_point_timestamp, uint32_t *datasize, void **result);
+    int readMulti(const uint32_t *keys, size_t n_keys, int64_t start_time, int64_t end_time, SERIES_RESULT *results);
+
+    size_t readLatest(const uint32_t *keys, size_t n_keys, LATEST *out);
+    size_t readAllLatest(vector<LATEST> *out);
+
+    // from_sequences, when given, holds the sequence to resume from for every shard
+    int subscribe(const uint32_t *keys, size_t n_keys, SHARD_FEED_CALLBACK callback, const uint64_t *from_sequences = NULL);
+    void unsubscribe(int id);
+    uint64_t lag(int id);
+
+    void flush();
+    void close();
+
+    unsigned int shardFor(uint32_t key);
+    unsigned int shardCount();
+
+    uint64_t writeErrors();
+
+
+    const char *data_directory;
+
+    int write_ahead_size;
+    int default_seconds_per_point;
+    char default_null_fill_byte;
+
+    bool pin_threads;
+    size_t max_queue_length; // writes and reads are rejected with SHARD_QUEUE_FULL past this, 0 = unbounded
+    size_t latest_capacity; // latest value table slots, split across shards
+    size_t feed_capacity; // change feed events, split across shards
+
+    bool shuttingDown;
+
+    ~BShardedSeries();
+
+private:
+    int post(SHARD *shard, SHARD_MESSAGE &message, bool bounded = true);
+    int runTask(SHARD *shard, function<void(BSeries*)> task, bool bounded = true);
+    void shardLoop(SHARD *shard);
+
+    vector<SHARD*> shards;
+    bool started;
+
+    mutex feed_access;
+    map<int, vector<int> > feed_subscriptions; // id -> subscription of every shard, -1 where the shard has none of the keys
+    int next_feed_id;
+};
+
+#endif // BSHARD_H
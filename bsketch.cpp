@@ -0,0 +1,178 @@
+#include "bsketch.h"
+
+#include <math.h>
+#include <string.h>
+
+
+
+static const double min_value = 1e-9;
+
+
+
+
+BQuantileSketch::BQuantileSketch(double relative_accuracy)
+{
+    alpha = relative_accuracy;
+    gamma = (1 + alpha) / (1 - alpha);
+    log_gamma = log(gamma);
+    zero = 0;
+    total = 0;
+}
+
+
+
+
+int32_t BQuantileSketch::index(double value) const{
+    return (int32_t)ceil(log(value) / log_gamma);
+}
+
+
+// Midpoint of the bin (in the relative sense), within alpha of every value in the bin
+
+double BQuantileSketch::value(int32_t index) const{
+    return 2 * pow(gamma,index) / (gamma + 1);
+}
+
+
+
+
+void BQuantileSketch::add(double value, uint64_t count){
+
+    if(value != value)
+        return;
+
+    if(value > min_value)
+        positive[index(value)] += count;
+    else if(value < -min_value)
+        negative[index(-value)] += count;
+    else
+        zero += count;
+
+    total += count;
+}
+
+
+void BQuantileSketch::addFloats(const float *values, int64_t n){
+    for(int64_t i = 0; i < n; i++)
+        add(values[i]);
+}
+
+
+
+
+bool BQuantileSketch::merge(const BQuantileSketch &other){
+
+    if(other.alpha != alpha)
+        return false;
+
+    for(auto it = other.positive.begin(); it != other.positive.end(); it++)
+        positive[it->first] += it->second;
+    for(auto it = other.negative.begin(); it != other.negative.end(); it++)
+        negative[it->first] += it->second;
+
+    zero += other.zero;
+    total += other.total;
+    return true;
+}
+
+
+
+
+/// Value at rank q * (count - 1), walking from the most negative bin up
+
+double BQuantileSketch::quantile(double q) const{
+
+    if(!total)
+        return NAN;
+
+    if(q < 0)
+        q = 0;
+    if(q > 1)
+        q = 1;
+
+    uint64_t rank = (uint64_t)(q * (total - 1));
+    uint64_t seen = 0;
+
+    for(auto it = negative.rbegin(); it != negative.rend(); it++){
+        seen += it->second;
+        if(seen > rank)
+            return -value(it->first);
+    }
+
+    seen += zero;
+    if(seen > rank)
+        return 0;
+
+    for(auto it = positive.begin(); it != positive.end(); it++){
+        seen += it->second;
+        if(seen > rank)
+            return value(it->first);
+    }
+
+    return value(positive.rbegin()->first);
+}
+
+
+
+
+/// Layout: alpha, zero count, number of positive and negative bins, then (index, count) pairs, positive first
+
+void BQuantileSketch::serialize(std::string *out) const{
+
+    uint32_t n_positive = positive.size();
+    uint32_t n_negative = negative.size();
+
+    out->append((const char*)&alpha,sizeof(alpha));
+    out->append((const char*)&zero,sizeof(zero));
+    out->append((const char*)&n_positive,sizeof(n_positive));
+    out->append((const char*)&n_negative,sizeof(n_negative));
+
+    for(int pass = 0; pass < 2; pass++){
+        const std::map<int32_t,uint64_t> &bins = pass ? negative : positive;
+        for(auto it = bins.begin(); it != bins.end(); it++){
+            int32_t index = it->first;
+            uint32_t count = it->second; // A block never holds more than 2^32 points
+            out->append((const char*)&index,sizeof(index));
+            out->append((const char*)&count,sizeof(count));
+        }
+    }
+}
+
+
+bool BQuantileSketch::deserialize(const char *data, size_t size){
+
+    double stored_alpha;
+    uint64_t stored_zero;
+    uint32_t n_positive, n_negative;
+
+    size_t fixed = sizeof(stored_alpha) + sizeof(stored_zero) + sizeof(n_positive) + sizeof(n_negative);
+    if(size < fixed)
+        return false;
+
+    memcpy(&stored_alpha,data,sizeof(stored_alpha));
+    memcpy(&stored_zero,data + 8,sizeof(stored_zero));
+    memcpy(&n_positive,data + 16,sizeof(n_positive));
+    memcpy(&n_negative,data + 20,sizeof(n_negative));
+
+    if(stored_alpha != alpha || size != fixed + ((size_t)n_positive + n_negative) * 8)
+        return false;
+
+    zero += stored_zero;
+    total += stored_zero;
+
+    const char *pair = data + fixed;
+    for(uint32_t i = 0; i < n_positive + n_negative; i++, pair += 8){
+        int32_t index;
+        uint32_t count;
+        memcpy(&index,pair,sizeof(index));
+        memcpy(&count,pair + 4,sizeof(count));
+
+        if(i < n_positive)
+            positive[index] += count;
+        else
+            negative[index] += count;
+        total += count;
+    }
+
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef BSKETCH_H
+#define BSKETCH_H
+
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <string>
+
+
+
+/// Mergeable quantile sketch (DDSketch style)
+///
+/// Values are counted in logarithmic bins, bin i holds values in (gamma^(i-1), gamma^i] with
+/// gamma = (1 + alpha) / (1 - alpha). Any quantile returned is within a relative error of alpha of the
+/// exact value at that rank: |estimate - exact| <= alpha * |exact|. Values with |v| < min_value count as zero.
+/// Merging adds bin counts so the bound holds for any number of merged sketches with the same alpha.
+
+class BQuantileSketch
+{
+public:
+    BQuantileSketch(double relative_accuracy = 0.01);
+
+    void add(double value, uint64_t count = 1);
+    void addFloats(const float *values, int64_t n); // NaN (null fill) is skipped
+    bool merge(const BQuantileSketch &other);
+
+    double quantile(double q) const; // NaN when empty
+    uint64_t count() const { return total; }
+
+    void serialize(std::string *out) const;
+    bool deserialize(const char *data, size_t size);
+
+    double alpha;
+
+private:
+    int32_t index(double value) const;
+    double value(int32_t index) const;
+
+    double gamma;
+    double log_gamma;
+
+    std::map<int32_t,uint64_t> positive;
+    std::map<int32_t,uint64_t> negative; // keyed by the index of -value
+    uint64_t zero;
+    uint64_t total;
+};
+
+
+#endif // BSKETCH_H
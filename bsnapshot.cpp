@@ -0,0 +1,310 @@
+#include "bseries.h"
+#include "debug.h"
+
+#include <set>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+
+
+
+/// Hot snapshots
+///
+/// A snapshot is a point in time across all series. It bumps snapshot_epoch under index_access, that is the cut,
+/// and from then on the first writer to lock a series freezes it before changing anything, the snapshot freezes
+/// the series nobody wrote to. Freezing only records the file size and copies the populated part of the write
+/// ahead cache under the series lock. The sealed part of each file is then copied without holding any lock
+/// (reflink when the filesystem supports it, copy_file_range or a plain copy otherwise).
+/// Appends never touch the sealed part, direct writes do, so while a snapshot is running write() saves the original
+/// bytes of any direct write below the frozen size and those are put back into the copy afterwards.
+/// Copies and the target directory are synced before snapshot() returns.
+///
+/// The result is a normal data directory, checksum sidecars are not copied, they are rebuilt when the copy is opened.
+
+
+
+/// Called by writers before overwriting bytes at offset in place
+
+void BSeries::preserveForSnapshot(ENTRY *series, BFile *file, int64_t offset, int64_t bytes){
+
+    if(series->snapshot_undo == NULL || offset >= series->snapshot_size)
+        return;
+
+    if(offset + bytes > series->snapshot_size)
+        bytes = series->snapshot_size - offset;
+
+    string original(bytes,0);
+    if(file->read(&original[0],bytes,offset) == bytes){
+        series->snapshot_undo->push_back(make_pair(offset,original));
+    } else {
+        _ERROR("\t Failed to preserve original data for snapshot\n");
+    }
+}
+
+
+
+
+/// Freezes series for the running snapshot unless that was done since the last cut.
+/// Called with the series locked, by writers before they change anything and by snapshot()
+
+void BSeries::freezeForSnapshot(uint32_t key, ENTRY *series){
+
+    uint64_t epoch = snapshot_epoch.load();
+    if(series->snapshot_epoch == epoch)
+        return;
+    series->snapshot_epoch = epoch;
+
+    FROZEN_SERIES f;
+    f.key = key;
+    f.series = series;
+    f.size = -1;
+    f.cache = NULL;
+    f.cache_bytes = 0;
+
+    if(series->header.checksum == getChecksum(&series->header)){
+        f.size = series->file_size;
+        if(series->write_ahead_cache != NULL && series->cache_points > 0){
+            f.cache_bytes = series->cache_points * series->header.datasize;
+            f.cache = (char*)malloc(f.cache_bytes);
+            if(f.cache != NULL)
+                memcpy(f.cache,series->write_ahead_cache,f.cache_bytes);
+            else
+                f.cache_bytes = 0;
+        }
+    } else {
+        // Not loaded, nobody can change the file without taking the series lock first
+        char filename[256];
+        sprintf(filename,"%s/%u",data_directory,key);
+        struct stat st;
+        if(stat(filename,&st) == 0)
+            f.size = st.st_size;
+    }
+
+    lock_guard<mutex> frozen(snapshot_frozen_access);
+
+    if(!snapshot_active){
+        // Created after the cut and the snapshot has already collected its series
+        free(f.cache);
+        return;
+    }
+
+    f.undo = new vector< pair<int64_t,string> >();
+    series->snapshot_size = f.size;
+    series->snapshot_undo = f.undo;
+
+    snapshot_frozen.push_back(f);
+}
+
+
+
+
+static bool copyRange(const char *source, const char *target, int64_t size){
+
+    int in = open(source,O_RDONLY);
+    if(in < 0)
+        return false;
+
+    int out = open(target,O_WRONLY | O_CREAT | O_TRUNC,0644);
+    if(out < 0){
+        ::close(in);
+        return false;
+    }
+
+    bool success = false;
+
+#ifdef FICLONE
+    // Reflink, shares the extents so this is constant time, then cut away anything appended since the freeze
+    if(ioctl(out,FICLONE,in) == 0)
+        success = ftruncate(out,size) == 0;
+#endif
+
+    int64_t done = 0;
+
+#ifdef __linux__
+    while(!success && done < size){
+        loff_t in_offset = done;
+        loff_t out_offset = done;
+        ssize_t n = copy_file_range(in,&in_offset,out,&out_offset,size - done,0);
+        if(n <= 0)
+            break; // Not supported here (or across filesystems), finish with a plain copy
+        done += n;
+    }
+    if(done == size)
+        success = true;
+#endif
+
+    if(!success){
+        char buffer[65536];
+        while(done < size){
+            int64_t chunk = size - done < (int64_t)sizeof(buffer) ? size - done : sizeof(buffer);
+            ssize_t n = pread(in,buffer,chunk,done);
+            if(n <= 0 || pwrite(out,buffer,n,done) != n)
+                break;
+            done += n;
+        }
+        success = done == size;
+    }
+
+    ::close(in);
+    ::close(out);
+    return success;
+}
+
+
+
+
+/// Writes a point in time copy of all series to target_directory while writes continue.
+/// Writers are paused only for the freeze of their own series, a lock, a size and a copy of the cached points.
+/// Returns NO_ERROR or SNAPSHOT_FAILED
+
+int BSeries::snapshot(const char *target_directory){
+
+    if(shuttingDown)
+        return SNAPSHOT_FAILED;
+
+    lock_guard<mutex> single(snapshot_access);
+
+    cout << "Snapshot to " << target_directory << endl;
+
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+    if(mkdir(target_directory,0755) != 0 && errno != EEXIST){
+        _ERROR("Failed to create snapshot directory %s\n",target_directory);
+        return SNAPSHOT_FAILED;
+    }
+
+
+    snapshot_frozen_access.lock();
+    snapshot_frozen.clear();
+    snapshot_active = true;
+    snapshot_frozen_access.unlock();
+
+
+    // The cut, every series we have open plus every data file on disk
+    set<uint32_t> keys;
+
+    index_access.lock();
+    for(auto it = series_list.begin(); it != series_list.end(); it++)
+        keys.insert(it->first);
+    snapshot_epoch++;
+    index_access.unlock();
+
+    DIR *directory = opendir(data_directory);
+    if(directory != NULL){
+        struct dirent *item;
+        while((item = readdir(directory)) != NULL){
+            char *end;
+            unsigned long key = strtoul(item->d_name,&end,10);
+            if(end != item->d_name && *end == 0)
+                keys.insert(key);
+        }
+        closedir(directory);
+    }
+
+
+    // Freeze what writers have not frozen already
+    int64_t longest_hold = 0;
+
+    for(auto it = keys.begin(); it != keys.end(); it++){
+
+        index_access.lock();
+        ENTRY *series = &series_list[*it];
+        index_access.unlock();
+
+        series->access.lock();
+        chrono::steady_clock::time_point locked = chrono::steady_clock::now();
+
+        freezeForSnapshot(*it,series);
+
+        series->access.unlock();
+
+        int64_t held = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - locked).count();
+        if(held > longest_hold)
+            longest_hold = held;
+    }
+
+    vector<FROZEN_SERIES> frozen;
+
+    snapshot_frozen_access.lock();
+    snapshot_active = false;
+    frozen.swap(snapshot_frozen);
+    snapshot_frozen_access.unlock();
+
+
+    // Copy
+    int64_t bytes = 0;
+    size_t failed = 0;
+    size_t copied = 0;
+
+    for(size_t i = 0; i < frozen.size(); i++){
+        FROZEN_SERIES *f = &frozen[i];
+
+        char source[256];
+        char target[512];
+        sprintf(source,"%s/%u",data_directory,f->key);
+        snprintf(target,sizeof(target),"%s/%u",target_directory,f->key);
+
+        bool success = f->size < 0 || copyRange(source,target,f->size);
+
+        // Stop recording, everything after this point is newer than the snapshot
+        f->series->access.lock();
+        f->series->snapshot_undo = NULL;
+        f->series->access.unlock();
+
+        if(success && f->size >= 0){
+            int out = open(target,O_WRONLY);
+            if(out < 0){
+                success = false;
+            } else {
+                // Put back what direct writes replaced, oldest last so it wins
+                for(auto undo = f->undo->rbegin(); undo != f->undo->rend(); undo++){
+                    if(pwrite(out,undo->second.data(),undo->second.size(),undo->first) != (ssize_t)undo->second.size())
+                        success = false;
+                }
+
+                // Cached points go straight after the sealed part, exactly where the next flush would have put them
+                if(f->cache_bytes && pwrite(out,f->cache,f->cache_bytes,f->size) != f->cache_bytes)
+                    success = false;
+
+                if(fsync(out) != 0)
+                    success = false;
+
+                ::close(out);
+            }
+            bytes += f->size + f->cache_bytes;
+            copied++;
+        }
+
+        if(!success){
+            _ERROR("Failed to snapshot series %u\n",f->key);
+            failed++;
+        }
+
+        free(f->cache);
+        delete f->undo;
+    }
+
+
+    // The new entries must survive a crash as well as their contents
+    int target = open(target_directory,O_RDONLY | O_DIRECTORY);
+    if(target < 0 || fsync(target) != 0){
+        _ERROR("Failed to sync snapshot directory %s\n",target_directory);
+        failed++;
+    }
+    if(target >= 0)
+        ::close(target);
+
+
+    int64_t elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+    cout << "\t Done Snapshot, " << copied << " series, " << bytes << " bytes in " << elapsed << " ms, longest freeze " << longest_hold << " us" << endl;
+
+    return failed ? SNAPSHOT_FAILED : NO_ERROR;
+}
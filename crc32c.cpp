@@ -0,0 +1,102 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#endif
+
+
+
+
+static uint32_t crc_table[256];
+
+
+static uint32_t crc32cSoftware(uint32_t crc, const uint8_t *data, size_t length){
+
+    crc = ~crc;
+    while(length--)
+        crc = crc_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+
+#ifdef CRC32C_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSSE42(uint32_t crc, const uint8_t *data, size_t length){
+
+    crc = ~crc;
+
+    // Align to 8 bytes, then eat 8 bytes per instruction
+    while(length && ((uintptr_t)data & 7)){
+        crc = _mm_crc32_u8(crc,*data++);
+        length--;
+    }
+
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while(length >= 8){
+        uint64_t value;
+        memcpy(&value,data,8);
+        crc64 = _mm_crc32_u64(crc64,value);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+
+    while(length >= 4){
+        uint32_t value;
+        memcpy(&value,data,4);
+        crc = _mm_crc32_u32(crc,value);
+        data += 4;
+        length -= 4;
+    }
+
+    while(length--)
+        crc = _mm_crc32_u8(crc,*data++);
+
+    return ~crc;
+}
+
+#endif
+
+
+
+typedef uint32_t (*CRC_FUNCTION)(uint32_t crc, const uint8_t *data, size_t length);
+
+
+static CRC_FUNCTION crc32cSelect(){
+
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : (crc >> 1);
+        crc_table[i] = crc;
+    }
+
+#ifdef CRC32C_X86
+    if(__builtin_cpu_supports("sse4.2"))
+        return crc32cSSE42;
+#endif
+
+    return crc32cSoftware;
+}
+
+
+static CRC_FUNCTION crc_function = crc32cSelect();
+
+
+
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length){
+    return crc_function(crc,(const uint8_t*)data,length);
+}
+
+
+bool crc32cHardware(){
+    return crc_function != crc32cSoftware;
+}
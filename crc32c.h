@@ -0,0 +1,19 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+
+/// CRC32C (Castagnoli), uses the SSE 4.2 crc32 instruction when the cpu supports it and a table otherwise.
+/// Pass the previous result as crc to continue a checksum, crc32c(crc32c(0,a),b) == crc32c(0,a+b)
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+bool crc32cHardware();
+
+
+#endif // CRC32C_H
@@ -0,0 +1,87 @@
+/// bexport, bulk export and import of a bseries data directory
+///
+///     bexport export <data_directory> <target_directory> [arrow|csv] [threads]
+///     bexport import <source_directory> <data_directory> [threads]
+///
+/// Options before the command: -w <write_ahead_size> (default 4096), -i <seconds_per_point> (default 10)
+/// An interrupted export continues where it stopped when run again, imports can simply be run again.
+///
+/// g++ -O2 -std=c++11 -pthread -I.. -o bexport bexport.cpp ../b*.cpp ../crc32c.cpp
+
+#include "bseries.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+
+
+static void usage(){
+    fprintf(stderr,"usage: bexport [-w write_ahead_size] [-i seconds_per_point] export <data_directory> <target_directory> [arrow|csv] [threads]\n");
+    fprintf(stderr,"       bexport [-w write_ahead_size] [-i seconds_per_point] import <source_directory> <data_directory> [threads]\n");
+}
+
+
+int main(int argc, char **argv){
+
+    int write_ahead_size = 4096;
+    int seconds_per_point = 10;
+
+    int arg = 1;
+    while(arg + 1 < argc && argv[arg][0] == '-'){
+        if(strcmp(argv[arg],"-w") == 0)
+            write_ahead_size = atoi(argv[arg + 1]);
+        else if(strcmp(argv[arg],"-i") == 0)
+            seconds_per_point = atoi(argv[arg + 1]);
+        else
+            break;
+        arg += 2;
+    }
+
+    if(argc - arg < 3 || write_ahead_size <= 0 || seconds_per_point <= 0){
+        usage();
+        return 1;
+    }
+
+    const char *command = argv[arg];
+    bool exporting = strcmp(command,"export") == 0;
+
+    if(!exporting && strcmp(command,"import") != 0){
+        usage();
+        return 1;
+    }
+
+    BSeries db;
+    db.data_directory = exporting ? argv[arg + 1] : argv[arg + 2];
+    db.write_ahead_size = write_ahead_size;
+    db.default_seconds_per_point = seconds_per_point;
+
+    auto progress = [](size_t done, size_t total){
+        if(done % 1000 == 0 || done == total)
+            fprintf(stderr,"\r%zu / %zu",done,total);
+        if(done == total)
+            fprintf(stderr,"\n");
+    };
+
+    int status;
+    if(exporting){
+        int format = EXPORT_ARROW;
+        if(argc - arg > 3){
+            if(strcmp(argv[arg + 3],"csv") == 0){
+                format = EXPORT_CSV;
+            } else if(strcmp(argv[arg + 3],"arrow") != 0){
+                usage();
+                return 1;
+            }
+        }
+        unsigned int threads = argc - arg > 4 ? atoi(argv[arg + 4]) : 0;
+        status = db.exportData(argv[arg + 2],format,threads,progress);
+    } else {
+        unsigned int threads = argc - arg > 3 ? atoi(argv[arg + 3]) : 0;
+        status = db.importData(argv[arg + 1],threads,progress);
+    }
+
+    db.close();
+
+    return status == NO_ERROR ? 0 : 1;
+}
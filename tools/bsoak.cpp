@@ -0,0 +1,912 @@
+/// bsoak, fleet load generator and soak test
+///
+///     bsoak [options] <data_directory>
+///
+/// Simulates a fleet of devices writing float series at fixed cadences with jitter, devices that go offline for a while
+/// and upload what they buffered when they come back (backfill), and dashboards reading concurrently. Every report
+/// interval a line with write and read throughput, p50/p99/p999 latency, errors, RSS, open fds and disk bytes is printed.
+/// When the run ends (duration or Ctrl-C) the database is closed, reopened and every series is checked against an
+/// in-memory model of what was written.
+///
+/// A fleet is one or more profiles, -p count:interval[:jitter[:outages_per_day[:outage_seconds]]]
+///     interval in seconds (0.1 for sub-second series), jitter as a fraction of the interval (default 0.2),
+///     outages per device per day (default 1) lasting outage_seconds (default 3600).
+///
+/// Time is simulated, -s 60 runs an hour of fleet time per minute, if the writers can not keep up the "behind" column
+/// shows by how much (simulated seconds). Use an empty data directory, series that exist are reused but only the points
+/// written by this run are verified.
+///
+/// g++ -O2 -std=c++11 -pthread -I.. -o bsoak bsoak.cpp ../b*.cpp ../crc32c.cpp
+
+#include "bseries.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <queue>
+
+
+
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_EXPONENT 40 // ~18 minutes in ns
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS * (LATENCY_MAX_EXPONENT - LATENCY_SUB_BITS + 2))
+
+#define AGGREGATE_KEYS 100
+#define VERIFY_CHUNK_POINTS (1 << 20)
+
+
+/// Log linear latency histogram in ns, 32 buckets per power of two (~3% resolution).
+/// Written by one thread, read by the reporter
+
+typedef struct
+{
+    atomic<uint64_t> counts[LATENCY_BUCKETS];
+} LATENCY;
+
+
+typedef struct
+{
+    int64_t count;
+    int64_t interval; // ns
+    double jitter; // fraction of the interval
+    double outages_per_day;
+    int64_t outage; // ns
+} PROFILE;
+
+
+typedef struct
+{
+    uint32_t key;
+    const PROFILE *profile;
+    int64_t base; // timestamp of slot 0 (the series header timestamp), ns
+    int64_t first_slot; // first slot of this run
+    int64_t next_slot;
+    int64_t offline_until; // slot the device comes back at, 0 while online
+    int64_t last_slot; // last slot written, -1 for none
+    vector<uint64_t> written; // the model, bit i is slot first_slot + i
+    atomic<bool> started; // a point was written, readers may pick the device
+    bool disabled; // the series exists with another layout
+} DEVICE;
+
+
+typedef struct
+{
+    LATENCY latency;
+    LATENCY backfill_latency;
+    atomic<uint64_t> writes;
+    atomic<uint64_t> errors;
+    atomic<uint64_t> backfills;
+    atomic<uint64_t> backfill_points;
+    atomic<int64_t> behind; // ns, largest since the last report
+} WRITER_STATS;
+
+
+typedef struct
+{
+    LATENCY latency;
+    LATENCY aggregate_latency;
+    atomic<uint64_t> reads;
+    atomic<uint64_t> aggregates;
+    atomic<uint64_t> errors;
+} READER_STATS;
+
+
+typedef struct
+{
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+} LATENCY_TOTAL;
+
+
+
+
+static atomic<bool> stopping(false);
+
+static vector<PROFILE> profiles;
+static vector<DEVICE> *devices;
+static vector<WRITER_STATS*> writer_stats;
+static vector<READER_STATS*> reader_stats;
+static atomic<int64_t> offline(0);
+
+static double speed = 1;
+static double loss = 0;
+static int64_t read_window = 3600 * NS_PER_SECOND;
+static double reads_per_second = 200;
+static double aggregate_share = 0.05;
+
+static int64_t sim_start;
+static chrono::steady_clock::time_point real_start;
+
+
+
+
+static void usage(){
+    fprintf(stderr,"usage: bsoak [options] <data_directory>\n");
+    fprintf(stderr,"  -p count:interval[:jitter[:outages_per_day[:outage_seconds]]]  device profile, repeatable (default -p 9000:10 -p 1000:1)\n");
+    fprintf(stderr,"  -d seconds         run time, 0 = until interrupted (default 60)\n");
+    fprintf(stderr,"  -s speed           simulated seconds per second (default 1)\n");
+    fprintf(stderr,"  -W threads         writer threads (default 4)\n");
+    fprintf(stderr,"  -r threads         reader threads (default 2)\n");
+    fprintf(stderr,"  -x reads           reads per second over all readers, 0 = unthrottled (default 200)\n");
+    fprintf(stderr,"  -g percent         share of reads that aggregate %d series (default 5)\n",AGGREGATE_KEYS);
+    fprintf(stderr,"  -q seconds         read window (default 3600)\n");
+    fprintf(stderr,"  -l fraction        share of points that are lost and never written (default 0)\n");
+    fprintf(stderr,"  -k key             first key (default 1)\n");
+    fprintf(stderr,"  -w points          write_ahead_size (default 4096)\n");
+    fprintf(stderr,"  -C megabytes       read cache (default 0)\n");
+    fprintf(stderr,"  -R seconds         report interval (default 10)\n");
+    fprintf(stderr,"  -o file            also write the report as csv\n");
+    fprintf(stderr,"  -c                 block checksums\n");
+    fprintf(stderr,"  -v                 verify_on_read\n");
+    fprintf(stderr,"  -n                 skip the final verification\n");
+}
+
+
+static void interrupted(int){
+    stopping = true;
+}
+
+
+
+
+static int64_t realNs(){
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static int64_t simNow(){
+    return sim_start + (int64_t)(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - real_start).count() * speed);
+}
+
+
+static uint64_t nextRandom(uint64_t *state){ // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+
+static double uniform(uint64_t *state){
+    return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/// Value of a slot, a pure function of key and slot so the model only has to remember which slots were written
+
+static float pointValue(uint32_t key, int64_t slot){
+    uint64_t h = key * 0x9E3779B97F4A7C15ULL ^ (uint64_t)slot * 0xC2B2AE3D27D4EB4FULL;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return (float)(h % 1000000) / 16; // exact in a float, never NaN
+}
+
+
+
+
+static void record(LATENCY *latency, int64_t ns){
+    uint64_t v = ns > 0 ? ns : 0;
+    size_t bucket;
+    if(v < LATENCY_SUB_BUCKETS){
+        bucket = v;
+    } else {
+        int exponent = 63 - __builtin_clzll(v);
+        if(exponent > LATENCY_MAX_EXPONENT){
+            exponent = LATENCY_MAX_EXPONENT;
+            v = ((uint64_t)2 << exponent) - 1;
+        }
+        bucket = LATENCY_SUB_BUCKETS * (exponent - LATENCY_SUB_BITS + 1) + ((v >> (exponent - LATENCY_SUB_BITS)) - LATENCY_SUB_BUCKETS);
+    }
+    latency->counts[bucket].fetch_add(1,memory_order_relaxed);
+}
+
+
+static double bucketValue(size_t bucket){ // middle of the bucket, ns
+    if(bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t mantissa = bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+    return (mantissa << shift) + ((uint64_t)1 << shift) / 2.0;
+}
+
+
+static void addLatency(LATENCY_TOTAL *total, LATENCY *latency){
+    for(size_t i = 0; i < LATENCY_BUCKETS; i++){
+        uint64_t count = latency->counts[i].load(memory_order_relaxed);
+        total->counts[i] += count;
+        total->total += count;
+    }
+}
+
+
+static void subtractLatency(LATENCY_TOTAL *total, const LATENCY_TOTAL *previous){
+    for(size_t i = 0; i < LATENCY_BUCKETS; i++)
+        total->counts[i] -= previous->counts[i];
+    total->total -= previous->total;
+}
+
+
+static double percentile(const LATENCY_TOTAL *total, double q){ // microseconds
+    if(!total->total)
+        return 0;
+    uint64_t rank = (uint64_t)ceil(q * total->total);
+    if(rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for(size_t i = 0; i < LATENCY_BUCKETS; i++){
+        seen += total->counts[i];
+        if(seen >= rank)
+            return bucketValue(i) / 1000;
+    }
+    return bucketValue(LATENCY_BUCKETS - 1) / 1000;
+}
+
+
+
+
+static int64_t residentBytes(){
+    FILE *statm = fopen("/proc/self/statm","r");
+    if(statm == NULL)
+        return -1;
+    long long pages = 0, resident = 0;
+    if(fscanf(statm,"%lld %lld",&pages,&resident) != 2)
+        resident = -1;
+    fclose(statm);
+    return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+}
+
+
+static int64_t openFiles(){
+    DIR *dir = opendir("/proc/self/fd");
+    if(dir == NULL)
+        return -1;
+    int64_t n = 0;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL){
+        if(entry->d_name[0] != '.')
+            n++;
+    }
+    closedir(dir);
+    return n - 1; // our own handle on the directory
+}
+
+
+static int64_t diskBytes(const string &path){
+    DIR *dir = opendir(path.c_str());
+    if(dir == NULL)
+        return 0;
+    int64_t bytes = 0;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL){
+        if(strcmp(entry->d_name,".") == 0 || strcmp(entry->d_name,"..") == 0)
+            continue;
+        string child = path + "/" + entry->d_name;
+        struct stat st;
+        if(lstat(child.c_str(),&st) != 0)
+            continue;
+        if(S_ISDIR(st.st_mode))
+            bytes += diskBytes(child);
+        else
+            bytes += (int64_t)st.st_blocks * 512;
+    }
+    closedir(dir);
+    return bytes;
+}
+
+
+
+
+static bool parseProfile(const char *text, PROFILE *profile){
+    long long count = 0;
+    double interval = 0;
+    double outage = 3600;
+    profile->jitter = 0.2;
+    profile->outages_per_day = 1;
+    if(sscanf(text,"%lld:%lf:%lf:%lf:%lf",&count,&interval,&profile->jitter,&profile->outages_per_day,&outage) < 2)
+        return false;
+    profile->count = count;
+    profile->interval = llround(interval * NS_PER_SECOND);
+    profile->outage = llround(outage * NS_PER_SECOND);
+    if(profile->jitter >= 1)
+        profile->jitter = 0.999;
+    return profile->count > 0 && profile->interval > 0 && profile->jitter >= 0 && profile->outages_per_day >= 0 && profile->outage >= 0;
+}
+
+
+static void markWritten(DEVICE *device, int64_t slot){
+    int64_t i = slot - device->first_slot;
+    if((size_t)(i / 64) >= device->written.size())
+        device->written.resize(i / 64 + 1024,0);
+    device->written[i / 64] |= (uint64_t)1 << (i % 64);
+    if(slot > device->last_slot)
+        device->last_slot = slot;
+}
+
+
+static bool wasWritten(const DEVICE *device, int64_t slot){
+    int64_t i = slot - device->first_slot;
+    return (size_t)(i / 64) < device->written.size() && (device->written[i / 64] >> (i % 64)) & 1;
+}
+
+
+
+
+/// Creates (or reopens) the series of every device owned by a writer, the layout must match the profile
+
+static void defineDevices(BSeries *db, size_t writer, size_t writers, atomic<size_t> *disabled){
+
+    uint64_t random = 0x853C49E6748FEA9BULL + writer;
+
+    for(size_t i = writer; i < devices->size(); i += writers){
+        DEVICE *device = &(*devices)[i];
+        int64_t interval = device->profile->interval;
+
+        // Devices are not in step, every one starts somewhere in its first interval
+        int64_t base = sim_start + (int64_t)(nextRandom(&random) % (uint64_t)interval);
+
+        SERIES header;
+        if(db->defineSeries(device->key,DATATYPE_FLOAT,sizeof(float),interval,base) != NO_ERROR ||
+           db->readHeader(device->key,&header) != NO_ERROR || header.interval != interval){
+            device->disabled = true;
+            (*disabled)++;
+            continue;
+        }
+
+        device->base = header.timestamp;
+        device->first_slot = sim_start > device->base ? (sim_start - device->base + interval - 1) / interval : 0;
+        device->next_slot = device->first_slot;
+    }
+}
+
+
+
+
+static int64_t dueTime(DEVICE *device, int64_t slot, uint64_t *random){
+    int64_t interval = device->profile->interval;
+    return device->base + slot * interval + (int64_t)(uniform(random) * device->profile->jitter * interval);
+}
+
+
+/// Drives the devices owned by one writer (device index % writers), each device is only ever written by its writer
+/// so its points arrive in order and its model needs no locking
+
+static void writerLoop(BSeries *db, size_t writer, size_t writers){
+
+    WRITER_STATS *stats = writer_stats[writer];
+    uint64_t random = 0x9E3779B97F4A7C15ULL + writer;
+    vector<float> backfill;
+
+    typedef pair<int64_t,size_t> EVENT; // due time, device
+    priority_queue<EVENT, vector<EVENT>, greater<EVENT> > queue;
+
+    for(size_t i = writer; i < devices->size(); i += writers){
+        DEVICE *device = &(*devices)[i];
+        if(!device->disabled)
+            queue.push(EVENT(dueTime(device,device->next_slot,&random),i));
+    }
+
+    while(!stopping && !queue.empty()){
+
+        EVENT event = queue.top();
+        int64_t now = simNow();
+        if(event.first > now){
+            int64_t wait = (int64_t)((event.first - now) / speed);
+            this_thread::sleep_for(chrono::nanoseconds(wait < 1000000 ? wait : 1000000));
+            continue;
+        }
+        queue.pop();
+
+        if(now - event.first > stats->behind.load(memory_order_relaxed))
+            stats->behind = now - event.first;
+
+        DEVICE *device = &(*devices)[event.second];
+        const PROFILE *profile = device->profile;
+
+        // Back from an outage, upload everything buffered while offline in one go
+        if(device->offline_until){
+            int64_t n = device->offline_until - device->next_slot;
+            backfill.resize(n);
+            for(int64_t i = 0; i < n; i++)
+                backfill[i] = pointValue(device->key,device->next_slot + i);
+
+            int64_t started = realNs();
+            int status = db->writeRangeNs(device->key,device->base + device->next_slot * profile->interval,backfill.data(),n,sizeof(float),profile->interval,DATATYPE_FLOAT);
+            record(&stats->backfill_latency,realNs() - started);
+
+            if(status == NO_ERROR){
+                for(int64_t i = 0; i < n; i++)
+                    markWritten(device,device->next_slot + i);
+                stats->backfills++;
+                stats->backfill_points += n;
+            } else {
+                stats->errors++;
+            }
+
+            device->next_slot = device->offline_until;
+            device->offline_until = 0;
+            offline--;
+        }
+
+        int64_t slot = device->next_slot;
+
+        if(uniform(&random) < profile->outages_per_day * profile->interval / (86400.0 * NS_PER_SECOND)){
+            device->offline_until = slot + (profile->outage + profile->interval - 1) / profile->interval;
+            if(device->offline_until == slot)
+                device->offline_until = slot + 1;
+            offline++;
+            queue.push(EVENT(dueTime(device,device->offline_until,&random),event.second));
+            continue;
+        }
+
+        if(!loss || uniform(&random) >= loss){
+            float value = pointValue(device->key,slot);
+
+            int64_t started = realNs();
+            int status = db->writeNs(device->key,&value,sizeof(float),event.first);
+            record(&stats->latency,realNs() - started);
+
+            if(status == NO_ERROR){
+                markWritten(device,slot);
+                stats->writes++;
+                if(!device->started)
+                    device->started = true;
+            } else {
+                stats->errors++;
+            }
+        }
+
+        device->next_slot = slot + 1;
+        queue.push(EVENT(dueTime(device,device->next_slot,&random),event.second));
+    }
+}
+
+
+
+
+static DEVICE* pickDevice(uint64_t *random){
+    for(int attempt = 0; attempt < 16; attempt++){
+        DEVICE *device = &(*devices)[nextRandom(random) % devices->size()];
+        if(device->started)
+            return device;
+    }
+    return NULL;
+}
+
+
+/// Dashboards, reads of the last read_window of one device and now and then an average per minute over many devices
+
+static void readerLoop(BSeries *db, size_t reader, size_t readers){
+
+    READER_STATS *stats = reader_stats[reader];
+    uint64_t random = 0xDA942042E4DD58B5ULL + reader;
+    int64_t pause = reads_per_second > 0 ? (int64_t)(readers * 1e9 / reads_per_second) : 0;
+    int64_t next = realNs();
+
+    while(!stopping){
+
+        if(pause){
+            next += pause;
+            int64_t wait = next - realNs();
+            if(wait > 0)
+                this_thread::sleep_for(chrono::nanoseconds(wait));
+            else if(wait < -NS_PER_SECOND)
+                next = realNs(); // do not burst after a stall
+        }
+
+        int64_t end = simNow();
+
+        if(uniform(&random) < aggregate_share){
+            uint32_t keys[AGGREGATE_KEYS];
+            size_t n_keys = 0;
+            for(int i = 0; i < AGGREGATE_KEYS; i++){
+                DEVICE *device = pickDevice(&random);
+                if(device)
+                    keys[n_keys++] = device->key;
+            }
+            int64_t start = (end - read_window) / NS_PER_SECOND;
+            if(!n_keys || start <= 0)
+                continue;
+
+            double *result = NULL;
+            int64_t n_buckets = 0;
+            int64_t started = realNs();
+            int status = db->readGroupAggregate(keys,n_keys,start,end / NS_PER_SECOND + 1,60,AGGREGATE_AVG,&result,&n_buckets,NULL,1);
+            record(&stats->aggregate_latency,realNs() - started);
+
+            if(status == NO_ERROR)
+                stats->aggregates++;
+            else
+                stats->errors++;
+            delete[] result;
+            continue;
+        }
+
+        DEVICE *device = pickDevice(&random);
+        if(device == NULL)
+            continue;
+
+        int64_t start = end - read_window;
+        int64_t first = device->base + device->first_slot * device->profile->interval;
+        if(start < first)
+            start = first;
+        if(start >= end)
+            continue;
+
+        int64_t n_points = 0, real_points = 0, interval = 0, first_point_timestamp = 0;
+        uint32_t datasize = 0;
+        void *result = NULL;
+
+        int64_t started = realNs();
+        int status = db->readNs(device->key,start,end,&n_points,&real_points,&interval,&first_point_timestamp,&datasize,&result);
+        record(&stats->latency,realNs() - started);
+
+        if(status == NO_ERROR)
+            stats->reads++;
+        else
+            stats->errors++;
+        if(result)
+            delete[] (char*)result;
+    }
+}
+
+
+
+
+/// Reads back every point this run wrote, written slots must hold their value and lost slots must be null
+
+static void verifyWorker(BSeries *db, atomic<size_t> *next, atomic<int64_t> *points, atomic<int64_t> *mismatches, atomic<size_t> *failed, mutex *print_access){
+
+    char *buffer = (char*)malloc((int64_t)VERIFY_CHUNK_POINTS * sizeof(float));
+    if(buffer == NULL){
+        (*failed)++;
+        return;
+    }
+
+    size_t i;
+    while((i = (*next)++) < devices->size()){
+        DEVICE *device = &(*devices)[i];
+        if(device->disabled || device->last_slot < 0)
+            continue;
+
+        int64_t interval = device->profile->interval;
+        int64_t bad = 0;
+        int64_t first_bad = -1;
+
+        for(int64_t slot = device->first_slot; slot <= device->last_slot; slot += VERIFY_CHUNK_POINTS){
+            int64_t end_slot = slot + VERIFY_CHUNK_POINTS <= device->last_slot + 1 ? slot + VERIFY_CHUNK_POINTS : device->last_slot + 1;
+
+            int64_t n_points = 0, real_points = 0, read_interval = 0, first_point_timestamp = 0;
+            uint32_t datasize = 0;
+            void *result = NULL;
+
+            int status = db->readNs(device->key,device->base + slot * interval,device->base + end_slot * interval,&n_points,&real_points,&read_interval,&first_point_timestamp,&datasize,&result,buffer,VERIFY_CHUNK_POINTS);
+            if(status != NO_ERROR || n_points != end_slot - slot || datasize != sizeof(float)){
+                lock_guard<mutex> lock(*print_access);
+                fprintf(stderr,"verify: series %u slots %lld-%lld read failed (%d, %lld points)\n",device->key,(long long)slot,(long long)end_slot,status,(long long)n_points);
+                (*failed)++;
+                break;
+            }
+
+            const float *values = (const float*)buffer;
+            for(int64_t j = 0; j < n_points; j++){
+                bool ok;
+                if(wasWritten(device,slot + j)){
+                    float expected = pointValue(device->key,slot + j);
+                    ok = memcmp(&values[j],&expected,sizeof(float)) == 0;
+                } else {
+                    ok = values[j] != values[j];
+                }
+                if(!ok){
+                    if(first_bad < 0)
+                        first_bad = slot + j;
+                    bad++;
+                }
+            }
+            (*points) += n_points;
+        }
+
+        if(bad){
+            lock_guard<mutex> lock(*print_access);
+            fprintf(stderr,"verify: series %u has %lld wrong points, first at slot %lld\n",device->key,(long long)bad,(long long)first_bad);
+            (*mismatches) += bad;
+        }
+    }
+
+    free(buffer);
+}
+
+
+
+
+static void printLatency(const char *name, const LATENCY_TOTAL *total){
+    printf("  %-10s %12llu  p50 %9.1f  p99 %9.1f  p999 %9.1f us\n",name,(unsigned long long)total->total,
+           percentile(total,0.5),percentile(total,0.99),percentile(total,0.999));
+}
+
+
+int main(int argc, char **argv){
+
+    int64_t duration = 60;
+    unsigned int writers = 4;
+    unsigned int readers = 2;
+    uint32_t first_key = 1;
+    int write_ahead_size = 4096;
+    int64_t cache_megabytes = 0;
+    int64_t report_interval = 10;
+    const char *report_file = NULL;
+    bool checksums = false;
+    bool verify_reads = false;
+    bool verify = true;
+
+    int arg = 1;
+    while(arg < argc && argv[arg][0] == '-'){
+        const char *option = argv[arg];
+        if(strcmp(option,"-c") == 0 || strcmp(option,"-v") == 0 || strcmp(option,"-n") == 0){
+            checksums |= option[1] == 'c';
+            verify_reads |= option[1] == 'v';
+            verify &= option[1] != 'n';
+            arg++;
+            continue;
+        }
+        if(arg + 1 >= argc || strlen(option) != 2){
+            usage();
+            return 1;
+        }
+        const char *value = argv[arg + 1];
+        switch(option[1]){
+        case 'p': {
+            PROFILE profile;
+            if(!parseProfile(value,&profile)){
+                fprintf(stderr,"Invalid profile: %s\n",value);
+                return 1;
+            }
+            profiles.push_back(profile);
+            break;
+        }
+        case 'd': duration = atoll(value); break;
+        case 's': speed = atof(value); break;
+        case 'W': writers = atoi(value); break;
+        case 'r': readers = atoi(value); break;
+        case 'x': reads_per_second = atof(value); break;
+        case 'g': aggregate_share = atof(value) / 100; break;
+        case 'q': read_window = llround(atof(value) * NS_PER_SECOND); break;
+        case 'l': loss = atof(value); break;
+        case 'k': first_key = strtoul(value,NULL,10); break;
+        case 'w': write_ahead_size = atoi(value); break;
+        case 'C': cache_megabytes = atoll(value); break;
+        case 'R': report_interval = atoll(value); break;
+        case 'o': report_file = value; break;
+        default:
+            usage();
+            return 1;
+        }
+        arg += 2;
+    }
+
+    if(argc - arg != 1 || speed <= 0 || !writers || write_ahead_size <= 0 || report_interval <= 0 || read_window <= 0){
+        usage();
+        return 1;
+    }
+
+    if(profiles.empty()){
+        PROFILE profile;
+        parseProfile("9000:10",&profile);
+        profiles.push_back(profile);
+        parseProfile("1000:1",&profile);
+        profiles.push_back(profile);
+    }
+
+    const char *data_directory = argv[arg];
+
+    FILE *report = NULL;
+    if(report_file != NULL){
+        if((report = fopen(report_file,"w")) == NULL){
+            fprintf(stderr,"Failed to open %s\n",report_file);
+            return 1;
+        }
+        fprintf(report,"elapsed,sim_seconds,writes_per_second,write_p50_us,write_p99_us,write_p999_us,reads_per_second,read_p50_us,read_p99_us,read_p999_us,"
+                       "errors,behind_seconds,offline,rss_bytes,open_files,disk_bytes\n");
+    }
+
+    signal(SIGINT,interrupted);
+    signal(SIGTERM,interrupted);
+
+
+    // Fleet
+    size_t n_devices = 0;
+    for(size_t p = 0; p < profiles.size(); p++)
+        n_devices += profiles[p].count;
+
+    devices = new vector<DEVICE>(n_devices);
+    size_t d = 0;
+    for(size_t p = 0; p < profiles.size(); p++){
+        for(int64_t i = 0; i < profiles[p].count; i++, d++){
+            DEVICE *device = &(*devices)[d];
+            device->key = first_key + d;
+            device->profile = &profiles[p];
+            device->offline_until = 0;
+            device->last_slot = -1;
+            device->started = false;
+            device->disabled = false;
+        }
+    }
+
+    BSeries *db = new BSeries();
+    db->data_directory = data_directory;
+    db->write_ahead_size = write_ahead_size;
+    db->block_checksums = checksums;
+    db->verify_on_read = verify_reads;
+    if(cache_megabytes > 0)
+        db->read_cache.setCapacity(cache_megabytes << 20);
+
+    // Start the simulated clock on a whole second, every series is defined before the run starts
+    sim_start = (int64_t)time(NULL) * NS_PER_SECOND;
+
+    printf("Defining %zu series\n",n_devices);
+    atomic<size_t> disabled(0);
+    {
+        vector<thread> workers;
+        for(size_t w = 0; w < writers; w++)
+            workers.push_back(thread(defineDevices,db,w,(size_t)writers,&disabled));
+        for(size_t w = 0; w < workers.size(); w++)
+            workers[w].join();
+    }
+    if(disabled)
+        printf("%zu series exist with another layout and are skipped\n",(size_t)disabled);
+
+
+    for(size_t w = 0; w < writers; w++)
+        writer_stats.push_back(new WRITER_STATS());
+    for(size_t r = 0; r < readers; r++)
+        reader_stats.push_back(new READER_STATS());
+
+    real_start = chrono::steady_clock::now();
+
+    vector<thread> threads;
+    for(size_t w = 0; w < writers; w++)
+        threads.push_back(thread(writerLoop,db,w,(size_t)writers));
+    for(size_t r = 0; r < readers; r++)
+        threads.push_back(thread(readerLoop,db,r,(size_t)readers));
+
+
+    // Report until the run time is up
+    printf("%8s %8s %9s %8s %8s %8s %9s %8s %8s %8s %7s %7s %7s %8s %6s %9s\n","elapsed","sim","writes/s","w_p50","w_p99","w_p999",
+           "reads/s","r_p50","r_p99","r_p999","errors","behind","offline","rss_MB","fds","disk_MB");
+
+    LATENCY_TOTAL previous_writes = {}, previous_reads = {};
+    uint64_t previous_errors = 0;
+    int64_t last_report = realNs();
+
+    while(!stopping){
+
+        this_thread::sleep_for(chrono::milliseconds(100));
+
+        int64_t now = realNs();
+        int64_t elapsed = now - chrono::duration_cast<chrono::nanoseconds>(real_start.time_since_epoch()).count();
+        bool done = duration > 0 && elapsed >= duration * NS_PER_SECOND;
+        if(now - last_report < report_interval * NS_PER_SECOND && !done)
+            continue;
+
+        double seconds = (now - last_report) / 1e9;
+        last_report = now;
+
+        LATENCY_TOTAL writes = {}, reads = {};
+        uint64_t errors = 0;
+        int64_t behind = 0;
+        for(size_t w = 0; w < writers; w++){
+            addLatency(&writes,&writer_stats[w]->latency);
+            errors += writer_stats[w]->errors;
+            int64_t b = writer_stats[w]->behind.exchange(0);
+            behind = b > behind ? b : behind;
+        }
+        for(size_t r = 0; r < readers; r++){
+            addLatency(&reads,&reader_stats[r]->latency);
+            addLatency(&reads,&reader_stats[r]->aggregate_latency);
+            errors += reader_stats[r]->errors;
+        }
+
+        LATENCY_TOTAL interval_writes = writes, interval_reads = reads;
+        subtractLatency(&interval_writes,&previous_writes);
+        subtractLatency(&interval_reads,&previous_reads);
+        previous_writes = writes;
+        previous_reads = reads;
+
+        int64_t rss = residentBytes();
+        int64_t fds = openFiles();
+        int64_t disk = diskBytes(data_directory);
+
+        printf("%8.0f %8.0f %9.0f %8.1f %8.1f %8.1f %9.0f %8.1f %8.1f %8.1f %7llu %7.1f %7lld %8.1f %6lld %9.1f\n",
+               elapsed / 1e9,(simNow() - sim_start) / 1e9,interval_writes.total / seconds,
+               percentile(&interval_writes,0.5),percentile(&interval_writes,0.99),percentile(&interval_writes,0.999),
+               interval_reads.total / seconds,percentile(&interval_reads,0.5),percentile(&interval_reads,0.99),percentile(&interval_reads,0.999),
+               (unsigned long long)(errors - previous_errors),behind / 1e9,(long long)offline.load(),rss / 1048576.0,(long long)fds,disk / 1048576.0);
+        fflush(stdout);
+
+        if(report){
+            fprintf(report,"%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%llu,%.3f,%lld,%lld,%lld,%lld\n",
+                    elapsed / 1e9,(simNow() - sim_start) / 1e9,interval_writes.total / seconds,
+                    percentile(&interval_writes,0.5),percentile(&interval_writes,0.99),percentile(&interval_writes,0.999),
+                    interval_reads.total / seconds,percentile(&interval_reads,0.5),percentile(&interval_reads,0.99),percentile(&interval_reads,0.999),
+                    (unsigned long long)(errors - previous_errors),behind / 1e9,(long long)offline.load(),(long long)rss,(long long)fds,(long long)disk);
+            fflush(report);
+        }
+        previous_errors = errors;
+
+        if(done)
+            stopping = true;
+    }
+
+    for(size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    if(report)
+        fclose(report);
+
+
+    // Totals over the whole run
+    LATENCY_TOTAL writes = {}, backfills = {}, reads = {}, aggregates = {};
+    uint64_t write_errors = 0, read_errors = 0, backfill_points = 0;
+    for(size_t w = 0; w < writers; w++){
+        addLatency(&writes,&writer_stats[w]->latency);
+        addLatency(&backfills,&writer_stats[w]->backfill_latency);
+        write_errors += writer_stats[w]->errors;
+        backfill_points += writer_stats[w]->backfill_points;
+    }
+    for(size_t r = 0; r < readers; r++){
+        addLatency(&reads,&reader_stats[r]->latency);
+        addLatency(&aggregates,&reader_stats[r]->aggregate_latency);
+        read_errors += reader_stats[r]->errors;
+    }
+
+    double elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - real_start).count() / 1e9;
+    printf("\n%zu series, %.0f seconds, %.0f simulated seconds\n",n_devices,elapsed,elapsed * speed);
+    printLatency("writes",&writes);
+    printLatency("backfills",&backfills);
+    printLatency("reads",&reads);
+    printLatency("aggregates",&aggregates);
+    printf("  %llu points backfilled, %llu write errors, %llu read errors\n",(unsigned long long)backfill_points,(unsigned long long)write_errors,(unsigned long long)read_errors);
+
+    db->close();
+    delete db;
+
+    if(!verify)
+        return write_errors || read_errors ? 2 : 0;
+
+
+    // Reopen and compare every series with the model
+    printf("\nVerifying\n");
+    db = new BSeries();
+    db->data_directory = data_directory;
+    db->write_ahead_size = write_ahead_size;
+    db->block_checksums = checksums;
+    db->verify_on_read = verify_reads;
+
+    atomic<size_t> next(0), failed(0);
+    atomic<int64_t> points(0), mismatches(0);
+    mutex print_access;
+    {
+        vector<thread> workers;
+        unsigned int n = thread::hardware_concurrency();
+        for(unsigned int w = 0; w < (n ? n : 1); w++)
+            workers.push_back(thread(verifyWorker,db,&next,&points,&mismatches,&failed,&print_access));
+        for(size_t w = 0; w < workers.size(); w++)
+            workers[w].join();
+    }
+
+    db->close();
+    delete db;
+
+    printf("  %lld points checked, %lld wrong, %zu series failed to read\n",(long long)points.load(),(long long)mismatches.load(),(size_t)failed);
+
+    if(mismatches || failed)
+        return 1;
+    return write_errors || read_errors ? 2 : 0;
+}